@@ -0,0 +1,205 @@
+/**
+ * @file affine.c
+ * @author Jason Denton
+ * @version 0.95
+ * @date May, 2009
+ *
+ * Copyright Jason Denton, 2009. This source code is made
+ * available under the terms of the new BSD license. See the file
+ * license.txt for the applicabe terms.
+ **/
+
+#include <math.h>
+#include "pntset.h"
+#include "pntmatch.h"
+#include "pmproblem.h"
+
+//pose[0] = a   pose[1] = b   pose[2] = tx
+//pose[3] = c   pose[4] = d   pose[5] = ty
+//the first two rows of the projective layout, so pose_to_hetro just
+//copies them.
+
+#define max(X,Y) (((X) < (Y)) ? (Y) : (X))
+
+void transform_affine(double* x, double* y, Pose pose)
+{
+  double tx,ty;
+
+  tx = *x * pose[0] + *y * pose[1] + pose[2];
+  ty = *x * pose[3] + *y * pose[4] + pose[5];
+  *x = tx;
+  *y = ty;
+}
+
+//transform_affine over n points. See PM_TRANSFORM_KERNEL.
+PM_TRANSFORM_KERNEL
+void transform_batch_affine(double* restrict x, double* restrict y,
+			    int n, Pose pose, double* restrict tx,
+			    double* restrict ty)
+{
+  double p0 = pose[0], p1 = pose[1], p2 = pose[2];
+  double p3 = pose[3], p4 = pose[4], p5 = pose[5];
+  int i;
+
+  for (i = 0; i < n; i++) {
+    tx[i] = x[i] * p0 + y[i] * p1 + p2;
+    ty[i] = x[i] * p3 + y[i] * p4 + p5;
+  }
+}
+
+//transform_batch_affine in single precision.
+PM_TRANSFORM_KERNEL
+void transform_batch_float_affine(float* restrict x, float* restrict y,
+				  int n, Pose pose, float* restrict tx,
+				  float* restrict ty)
+{
+  float p0 = pose[0], p1 = pose[1], p2 = pose[2];
+  float p3 = pose[3], p4 = pose[4], p5 = pose[5];
+  int i;
+
+  for (i = 0; i < n; i++) {
+    tx[i] = x[i] * p0 + y[i] * p1 + p2;
+    ty[i] = x[i] * p3 + y[i] * p4 + p5;
+  }
+}
+
+//Penalty for a pose that stretches the model too far in any direction,
+//or flips it over. The singular values of the linear part are the
+//largest and smallest stretch; otherwise as degeneracy_similarity.
+double degeneracy_affine(PointSet model, Pose pose, double scale)
+{
+  double e,det,s1,s2,sc;
+
+  det = pose[0] * pose[4] - pose[1] * pose[3];
+  if (!(det > 0.0)) return (double) model->size;
+  e = 0.5 * (pose[0] * pose[0] + pose[1] * pose[1] +
+	     pose[3] * pose[3] + pose[4] * pose[4]);
+  s1 = sqrt(e + sqrt(max(e * e - det * det,0.0)));
+  s2 = det / s1;
+  sc = max(s1,1.0/s2);
+  sc = max(sc-scale,0.0) * ((double)model->size/4.0);
+  return sc;
+}
+
+//Upper bound on the distance any point in the model's bounding box
+//moves when the pose changes from p to q.
+double pose_shift_affine(PointSet model, Pose p, Pose q)
+{
+  double X,Y,ex,ey;
+
+  X = max(fabs(model->lx),fabs(model->ux));
+  Y = max(fabs(model->ly),fabs(model->uy));
+  ex = fabs(p[0] - q[0]) * X + fabs(p[1] - q[1]) * Y + fabs(p[2] - q[2]);
+  ey = fabs(p[3] - q[3]) * X + fabs(p[4] - q[4]) * Y + fabs(p[5] - q[5]);
+  return sqrt(ex * ex + ey * ey);
+}
+
+//The sums of the normal equations of the least squares fit. The two
+//rows of the pose share the same left hand side.
+void context_for_pair_affine(double x, double y, double u, double v,
+			     double* context)
+{
+  context[0] = x;
+  context[1] = y;
+  context[2] = 1.0;
+  context[3] = x * x;
+  context[4] = x * y;
+  context[5] = y * y;
+  context[6] = u;
+  context[7] = x * u;
+  context[8] = y * u;
+  context[9] = v;
+  context[10] = x * v;
+  context[11] = y * v;
+}
+
+//Closed form least squares pose. The linear part comes from the sums
+//taken about the centroid of the model points, which keeps the 2x2
+//solve well conditioned for points far from the origin; translation is
+//whatever takes the model centroid to the data centroid.
+void pose_from_partial_affine(double* context, Pose pose)
+{
+  double n,sxx,sxy,syy,sxu,syu,sxv,syv,det;
+
+  n = context[2];
+  sxx = context[3] - context[0] * context[0] / n;
+  sxy = context[4] - context[0] * context[1] / n;
+  syy = context[5] - context[1] * context[1] / n;
+  sxu = context[7] - context[0] * context[6] / n;
+  syu = context[8] - context[1] * context[6] / n;
+  sxv = context[10] - context[0] * context[9] / n;
+  syv = context[11] - context[1] * context[9] / n;
+  det = sxx * syy - sxy * sxy;
+
+  pose[0] = (syy * sxu - sxy * syu) / det;
+  pose[1] = (sxx * syu - sxy * sxu) / det;
+  pose[3] = (syy * sxv - sxy * syv) / det;
+  pose[4] = (sxx * syv - sxy * sxv) / det;
+  pose[2] = (context[6] - pose[0] * context[0] - pose[1] * context[1]) / n;
+  pose[5] = (context[9] - pose[3] * context[0] - pose[4] * context[1]) / n;
+}
+
+//context_for_pair_affine for the model point x,y paired with each of
+//the PM_BATCH data points u[k],v[k], term j of lane k at
+//context[j*PM_BATCH+k].
+void context_for_pairs_batch_affine(double x, double y, double* u,
+				    double* v, double* context)
+{
+  int k;
+
+  for (k = 0; k < PM_BATCH; k++) {
+    context[0*PM_BATCH+k] = x;
+    context[1*PM_BATCH+k] = y;
+    context[2*PM_BATCH+k] = 1.0;
+    context[3*PM_BATCH+k] = x * x;
+    context[4*PM_BATCH+k] = x * y;
+    context[5*PM_BATCH+k] = y * y;
+    context[6*PM_BATCH+k] = u[k];
+    context[7*PM_BATCH+k] = x * u[k];
+    context[8*PM_BATCH+k] = y * u[k];
+    context[9*PM_BATCH+k] = v[k];
+    context[10*PM_BATCH+k] = x * v[k];
+    context[11*PM_BATCH+k] = y * v[k];
+  }
+}
+
+//Poses for partial + each lane of a batched context. Closed form, as
+//for similarity, so every lane is solved.
+int pose_from_partial_batch_affine(double* factor, double* partial,
+				   double* context, double* poses)
+{
+  double lane[12];
+  int j,k;
+
+  for (k = 0; k < PM_BATCH; k++) {
+    for (j = 0; j < 12; j++) lane[j] = partial[j] + context[j*PM_BATCH+k];
+    pose_from_partial_affine(lane,poses+k*6);
+  }
+  return (1 << PM_BATCH) - 1;
+}
+
+//Signature of an ordered cluster that affine transforms leave alone:
+//the coordinates of the fourth point in the frame of the first three,
+//(s - p) = alpha (q - p) + beta (r - p). If p, q and r are close to a
+//line the frame is dominated by noise, and the cluster gets none.
+//
+//return : The number of values in sig, 0 if the cluster has none.
+int cluster_invariant_affine(PointSet pset, int* cluster, int size,
+			     double* sig)
+{
+  double qx,qy,rx,ry,sx,sy,d;
+
+  if (size < 4) return 0;
+  qx = pset->x[cluster[1]] - pset->x[cluster[0]];
+  qy = pset->y[cluster[1]] - pset->y[cluster[0]];
+  rx = pset->x[cluster[2]] - pset->x[cluster[0]];
+  ry = pset->y[cluster[2]] - pset->y[cluster[0]];
+  sx = pset->x[cluster[3]] - pset->x[cluster[0]];
+  sy = pset->y[cluster[3]] - pset->y[cluster[0]];
+  d = qx * ry - qy * rx;
+  if (!(fabs(d) > 0.1 * sqrt((qx * qx + qy * qy) * (rx * rx + ry * ry))))
+    return 0;
+  sig[0] = (sx * ry - sy * rx) / d;
+  sig[1] = (qx * sy - qy * sx) / d;
+  return 2;
+}
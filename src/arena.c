@@ -0,0 +1,99 @@
+/**
+ * @file arena.c
+ * @author Jason Denton
+ * @version 0.95
+ * @date May, 2009
+ *
+ * Copyright Jason Denton, 2009. This source code is made
+ * available under the terms of the new BSD license. See the file
+ * license.txt for the applicabe terms.
+ **/
+
+#include <stdlib.h>
+#include "arena.h"
+
+//everything handed out is aligned for doubles (and then some)
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+#define ARENA_HEADER ARENA_ROUND(sizeof(ArenaBlockData))
+
+ArenaBlockData* arena_block(Arena arena, size_t size)
+{
+  ArenaBlockData* blk;
+
+  blk = (ArenaBlockData*) malloc(ARENA_HEADER + size);
+  blk->size = size;
+  blk->used = 0;
+  blk->next = arena->head;
+  arena->head = blk;
+  arena->total += size;
+  return blk;
+}
+
+/*
+ * Create an arena. Block is the size of the first block, and the
+ * smallest block the arena will grow by.
+ */
+Arena new_arena(size_t block)
+{
+  Arena arena;
+
+  arena = (Arena) malloc(sizeof(ArenaData));
+  arena->head = NULL;
+  arena->total = 0;
+  arena->block = ARENA_ROUND(block > 0 ? block : 4096);
+  arena_block(arena,arena->block);
+  return arena;
+}
+
+void* arena_alloc(Arena arena, size_t n)
+{
+  ArenaBlockData* blk;
+  void* mem;
+
+  n = ARENA_ROUND(n);
+  blk = arena->head;
+  if (blk->size - blk->used < n)
+    blk = arena_block(arena,n > arena->block ? n : arena->block);
+  mem = (char*) blk + ARENA_HEADER + blk->used;
+  blk->used += n;
+  return mem;
+}
+
+/*
+ * Release everything allocated from the arena. If the arena had to
+ * grow since the last reset, its blocks are replaced by one block big
+ * enough for all of them, so an arena that sees the same work over and
+ * over settles into a single block and stops calling malloc.
+ */
+void arena_reset(Arena arena)
+{
+  ArenaBlockData* blk;
+  size_t total;
+
+  if (arena->head->next) {
+    total = arena->total;
+    while (arena->head) {
+      blk = arena->head;
+      arena->head = blk->next;
+      free(blk);
+    }
+    arena->total = 0;
+    arena->block = total;
+    arena_block(arena,total);
+  }
+  arena->head->used = 0;
+}
+
+void free_arena(Arena arena)
+{
+  ArenaBlockData* blk;
+
+  if (!arena) return;
+  while (arena->head) {
+    blk = arena->head;
+    arena->head = blk->next;
+    free(blk);
+  }
+  free(arena);
+}
@@ -0,0 +1,50 @@
+/**
+ * @file arena.h
+ * @author Jason Denton
+ * @version 0.95
+ * @date May, 2009
+ *
+ * Copyright Jason Denton, 2009. This source code is made
+ * available under the terms of the new BSD license. See the file
+ * license.txt for the applicabe terms.
+ **/
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+// A bump allocator for short lived, per-thread scratch objects. Memory
+// comes out of large blocks and is only given back all at once by
+// arena_reset or free_arena, so worker threads can make temporary
+// matches and poses without going through malloc (and its lock) for
+// every one. An arena must only be used by one thread at a time.
+
+typedef struct ArenaBlockData {
+  struct ArenaBlockData* next;
+  size_t size;
+  size_t used;
+} ArenaBlockData;
+
+typedef struct {
+  ArenaBlockData* head;
+  size_t block;  // default block size
+  size_t total;  // bytes in all blocks
+} ArenaData;
+
+typedef ArenaData* Arena;
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+  Arena new_arena(size_t);
+  void* arena_alloc(Arena, size_t);
+  void arena_reset(Arena);
+  void free_arena(Arena);
+
+#ifdef __CPLUSPLUS
+}
+#endif
+
+#endif
@@ -13,9 +13,9 @@
    resulting return values. On single processor systems this is done
    with a simple for loop. On SMP systems the work is farmed out to
    all available CPUs. process_list attempts to keep all CPUs working
-   on the problem until all items on the list have been processed, and
-   to do so in such a way as to minimize the number of times a mutex
-   must be locked and unlocked. It does this by magic.
+   on the problem until all items on the list have been processed,
+   without taking any locks. It does this by work stealing, see the
+   scheduling notes below.
 
    process_list is called with a list_proc_obj, which describes the
    list to be processed and the function which should be called for
@@ -33,6 +33,30 @@
 #include "jadutil.h"
 #include "jadmath.h"
 
+/* Scheduling. The list is cut into chunks of a few items each, and
+   every thread starts out owning a contiguous range of "virtual"
+   chunk numbers. Virtual chunks are mapped to real ones round robin,
+   so that, like the old strided hand out, all threads work from the
+   front of the list first (lists are often sorted most promising
+   first). A thread takes chunks off the front of its own range. When
+   its range is empty it steals the back half of the fullest range it
+   can find, and quits when there is nothing left anywhere.
+
+   Each range is a pair of 32 bit chunk numbers packed in one 64 bit
+   word, so that taking and stealing are a single compare and swap. No
+   locks are taken at all. Item indices themselves are unsigned long,
+   a chunk holds as many items as it has to for the chunk count to fit
+   in 32 bits. */
+
+//Aim for this many chunks per thread, enough to even out a tail of
+//expensive items without making the ranges too busy.
+#define DC_CHUNKS_PER_THREAD 64
+
+#define DC_DONE ((unsigned long) -1)
+#define DC_RANGE(lo,hi) (((unsigned long long) (lo) << 32) | (hi))
+#define DC_LO(r) ((unsigned long) ((r) >> 32))
+#define DC_HI(r) ((unsigned long) ((r) & 0xffffffffULL))
+
 //Data structure used to track the list to be processed, the threads
 //processing it, and the helper functions used to process that list.
 
@@ -40,16 +64,16 @@ typedef struct {
   void** list_data;
   void** retlist;
   unsigned long list_size;
-  int* next;
-  int* last;
-  int* inc;
+  unsigned long chunk;    //items per chunk
+  unsigned long nchunks;  //real chunks
+  unsigned long per;      //virtual chunks given to each thread at start
+  volatile unsigned long long* range;
+  unsigned long* next;    //next item for each thread
+  unsigned long* last;    //one past the thread's last item
   int cpus;
-  int reserve;
-  int finished;
   int context_size;
   void** context;
-  pthread_t* tids;
-  pthread_mutex_t* mutex;
+  list_proc_obj lpo;
   void* pdata;
   void* (*action_func)(void*,void*,void*);
   void (*free_scratch_space)(void*,void*);
@@ -57,164 +81,413 @@ typedef struct {
 
 typedef Coordinator_Data* Coordinator;
 
+/* The thread pool. Threads are created the first time they are
+   needed, one per processor less the caller, and then live for the
+   rest of the process, waiting on a condition variable between
+   jobs. One caller at a time owns the pool; anyone else who asks for
+   it while it is busy, including a job that asks from inside the
+   pool, just does the work alone. */
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  int workers;        //pool threads, not counting the caller
+  unsigned long gen;  //bumped for each job
+  int pending;        //pool threads still busy with the current job
+  volatile int busy;  //set while a caller owns the pool
+  void (*job)(void*,int);
+  void* arg;
+  int njobs;
+} DC_Pool_Data;
+
+DC_Pool_Data dc_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+			PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, NULL, NULL, 0};
+pthread_once_t dc_pool_once = PTHREAD_ONCE_INIT;
+
+void* dc_pool_worker(void* p)
+{
+  int id;
+  unsigned long seen = 0;
+  void (*job)(void*,int);
+  void* arg;
+  int n;
+
+  id = (int) (long) p;
+  pthread_mutex_lock(&dc_pool.mutex);
+  for (;;) {
+    while (dc_pool.gen == seen)
+      pthread_cond_wait(&dc_pool.work,&dc_pool.mutex);
+    seen = dc_pool.gen;
+    job = dc_pool.job;
+    arg = dc_pool.arg;
+    n = dc_pool.njobs;
+    pthread_mutex_unlock(&dc_pool.mutex);
+    if (id < n) job(arg,id);
+    pthread_mutex_lock(&dc_pool.mutex);
+    if (--dc_pool.pending == 0) pthread_cond_signal(&dc_pool.done);
+  }
+  return NULL;
+}
+
+void dc_pool_init(void)
+{
+  pthread_t tid;
+  int i,n;
+
+  n = number_of_processors() - 1;
+  //workers are started before anyone can post a job, so they all see
+  //generation 0 as already done
+  for (i = 1; i <= n; i++)
+    if (!pthread_create(&tid,NULL,dc_pool_worker,(void*) (long) i)) {
+      pthread_detach(tid);
+      dc_pool.workers++;
+    }
+}
+
+/**
+ * @brief Number of threads a job started now could use.
+ *
+ * @return One more than the number of pool threads, or 1 if the pool
+ * is busy (for instance, when called from inside a pool job).
+ **/
+int pool_threads(void)
+{
+  if (number_of_processors() == 1) return 1;
+  pthread_once(&dc_pool_once,dc_pool_init);
+  return dc_pool.busy ? 1 : dc_pool.workers + 1;
+}
+
+/**
+ * @brief Run a job on the thread pool.
+ *
+ * Calls job(arg,id) once for every id from 0 to n-1 and returns when
+ * all of them have. Id 0 runs in the calling thread, the others on
+ * pool threads, concurrently. If the pool is busy, or has fewer
+ * threads than asked for, the calls that can't be given a thread of
+ * their own are made one after another in the caller.
+ *
+ * @param job The function to run.
+ * @param arg Passed to every call of job.
+ * @param n The number of calls to make.
+ **/
+void run_on_pool(void (*job)(void*,int), void* arg, int n)
+{
+  int i,use;
+
+  if (n > 1 && number_of_processors() > 1)
+    pthread_once(&dc_pool_once,dc_pool_init);
+  if (n <= 1 || dc_pool.workers == 0 ||
+      !__sync_bool_compare_and_swap(&dc_pool.busy,0,1)) {
+    for (i = 0; i < n; i++) job(arg,i);
+    return;
+  }
+
+  use = min(n,dc_pool.workers + 1);
+  pthread_mutex_lock(&dc_pool.mutex);
+  dc_pool.job = job;
+  dc_pool.arg = arg;
+  dc_pool.njobs = use;
+  dc_pool.pending = dc_pool.workers;
+  dc_pool.gen++;
+  pthread_cond_broadcast(&dc_pool.work);
+  pthread_mutex_unlock(&dc_pool.mutex);
+
+  job(arg,0);
+  for (i = use; i < n; i++) job(arg,i);
+
+  pthread_mutex_lock(&dc_pool.mutex);
+  while (dc_pool.pending) pthread_cond_wait(&dc_pool.done,&dc_pool.mutex);
+  pthread_mutex_unlock(&dc_pool.mutex);
+  __sync_lock_release(&dc_pool.busy);
+}
+
+/* Scratch space cache. A list_proc_obj with cache_scratch set gets its
+   per-thread scratch space from here, keyed by the shared block and
+   the allocation function, and it is kept after the list has been
+   processed for the next list with the same key. The cache must be
+   flushed before the shared block is freed. */
+
+typedef struct {
+  void* shared;
+  void* (*allocate)(void*);
+  void (*release)(void*,void*);
+  int in_use;
+  int count;
+  void** context;
+} DC_Scratch;
+
+DC_Scratch* dc_cache = NULL;
+int dc_cache_size = 0;
+pthread_mutex_t dc_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void release_scratch(void* shared, void (*release)(void*,void*),
+		     void** context, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (context[i] != NULL) {
+      if (release) release(shared,context[i]);
+      else free(context[i]);
+    }
+}
+
+//Scratch spaces for n threads. Hand them back with put_scratch.
+void** get_scratch(list_proc_obj lpo, int n)
+{
+  DC_Scratch* e = NULL;
+  void** context;
+  int i;
+
+  if (!lpo.allocate_scratch_space) {
+    context = malloc_array(void*,n);
+    for (i = 0; i < n; i++) context[i] = NULL;
+    return context;
+  }
+
+  if (lpo.cache_scratch) {
+    pthread_mutex_lock(&dc_cache_mutex);
+    for (i = 0; i < dc_cache_size; i++)
+      if (dc_cache[i].shared == lpo.shared &&
+	  dc_cache[i].allocate == lpo.allocate_scratch_space) break;
+    if (i == dc_cache_size) {
+      dc_cache = (DC_Scratch*) realloc(dc_cache,
+				       sizeof(DC_Scratch) * (i + 1));
+      dc_cache_size++;
+      dc_cache[i].shared = lpo.shared;
+      dc_cache[i].allocate = lpo.allocate_scratch_space;
+      dc_cache[i].release = lpo.free_scratch_space;
+      dc_cache[i].in_use = 0;
+      dc_cache[i].count = 0;
+      dc_cache[i].context = NULL;
+    }
+    //a list already using this entry, in another thread, gets to keep it
+    if (!dc_cache[i].in_use) {
+      e = dc_cache + i;
+      e->in_use = 1;
+    }
+    pthread_mutex_unlock(&dc_cache_mutex);
+  }
+
+  if (!e) {
+    context = malloc_array(void*,n);
+    for (i = 0; i < n; i++)
+      context[i] = lpo.allocate_scratch_space(lpo.shared);
+    return context;
+  }
+  if (e->count < n) {
+    e->context = (void**) realloc(e->context,sizeof(void*) * n);
+    for (i = e->count; i < n; i++)
+      e->context[i] = lpo.allocate_scratch_space(lpo.shared);
+    e->count = n;
+  }
+  return e->context;
+}
+
+void put_scratch(list_proc_obj lpo, void** context, int n)
+{
+  int i;
+
+  if (lpo.allocate_scratch_space && lpo.cache_scratch) {
+    pthread_mutex_lock(&dc_cache_mutex);
+    for (i = 0; i < dc_cache_size; i++)
+      if (dc_cache[i].context == context) {
+	dc_cache[i].in_use = 0;
+	pthread_mutex_unlock(&dc_cache_mutex);
+	return;
+      }
+    pthread_mutex_unlock(&dc_cache_mutex);
+  }
+  release_scratch(lpo.shared,lpo.free_scratch_space,context,n);
+  free(context);
+}
+
+/**
+ * @brief Free cached scratch space.
+ *
+ * Frees all scratch space cached for lists with the given shared
+ * block, or all cached scratch space if shared is NULL. Must be
+ * called before a shared block used with cache_scratch is freed, and
+ * not while a list using it is being processed.
+ *
+ * @param shared The shared block, or NULL.
+ **/
+void flush_scratch_cache(void* shared)
+{
+  int i,j;
+
+  pthread_mutex_lock(&dc_cache_mutex);
+  for (i = j = 0; i < dc_cache_size; i++) {
+    if (shared && dc_cache[i].shared != shared) {
+      dc_cache[j++] = dc_cache[i];
+      continue;
+    }
+    release_scratch(dc_cache[i].shared,dc_cache[i].release,
+		    dc_cache[i].context,dc_cache[i].count);
+    free(dc_cache[i].context);
+  }
+  dc_cache_size = j;
+  if (!j) {
+    free(dc_cache);
+    dc_cache = NULL;
+  }
+  pthread_mutex_unlock(&dc_cache_mutex);
+}
+
 //Helper function to setup a new coordinator
 Coordinator new_coordinator(list_proc_obj lpo,int cpus)			    
 {
   Coordinator coord; 
-  int i,j;
+  unsigned long want,idx;
+  int i;
   
   coord = (Coordinator) malloc(sizeof(Coordinator_Data));
   if (!coord) return NULL;
   
   coord->list_data = lpo.list;
   coord->list_size = lpo.list_size;
-  coord->next = (int*) malloc(sizeof(int) * cpus);
-  coord->last = (int*) malloc(sizeof(int) * cpus);
-  coord->inc = (int*) malloc(sizeof(int) * cpus);
+  want = (unsigned long) cpus * DC_CHUNKS_PER_THREAD;
+  coord->chunk = lpo.list_size / want + (lpo.list_size % want != 0);
+  if (coord->chunk < 1) coord->chunk = 1;
+  while ((lpo.list_size / coord->chunk) >= 0x7fffffffUL) coord->chunk *= 2;
+  coord->nchunks = (lpo.list_size + coord->chunk - 1) / coord->chunk;
+  coord->per = (coord->nchunks + cpus - 1) / cpus;
+  coord->range = (volatile unsigned long long*)
+    malloc(sizeof(unsigned long long) * cpus);
+  coord->next = (unsigned long*) malloc(sizeof(unsigned long) * cpus);
+  coord->last = (unsigned long*) malloc(sizeof(unsigned long) * cpus);
   coord->retlist = (void*) malloc(sizeof(void*) * lpo.list_size);
+  for (idx = 0; idx < lpo.list_size; idx++) coord->retlist[idx] = NULL;
   coord->cpus = cpus;
-  coord->tids = (pthread_t*) malloc(sizeof(pthread_t) * cpus);
-  coord->mutex = (pthread_mutex_t*) malloc(sizeof(pthread_mutex_t));
-  pthread_mutex_init(coord->mutex,NULL);
   coord->action_func = lpo.process_item;
   coord->pdata = lpo.shared;
-  coord->finished = 0;
-  coord->context = (void**) malloc(sizeof(void*) * cpus);
-  //not optimal for 1 processors, but the front end interface
-  //should screen for that case, and never do this for 1 processor
-  j = ((int)(lpo.list_size * 0.75))/cpus; //init list size per cpu
+  coord->lpo = lpo;
+  coord->context = get_scratch(lpo,cpus);
   for (i = 0; i < cpus; i++) {
-    coord->next[i] = i;
-    coord->last[i] = cpus*j+i;
-    coord->inc[i] = cpus;
-    if (lpo.allocate_scratch_space) 
-      coord->context[i] = lpo.allocate_scratch_space(lpo.shared);
-    else coord->context[i] = NULL;
+    coord->range[i] = DC_RANGE(i * coord->per, (i + 1) * coord->per);
+    coord->next[i] = coord->last[i] = 0;
   }
   coord->free_scratch_space = lpo.free_scratch_space;
-  coord->reserve = coord->last[cpus-1]+1;
   return coord;
 }
 
 //Helper function to cleanup a coordinator
 void delete_coordinator(Coordinator coord)
 {
-  int i;
-  for (i = 0; i < coord->cpus; i++)
-    if (coord->context[i] != NULL) {
-      if (coord->free_scratch_space)
-	coord->free_scratch_space(coord->pdata,coord->context[i]);
-      else free(coord->context[i]);
-    }
-
-  free(coord->context);  
+  put_scratch(coord->lpo,coord->context,coord->cpus);
+  free((void*) coord->range);
   free(coord->next);
   free(coord->last);
-  free(coord->inc);
-  free(coord->tids);
-  pthread_mutex_destroy(coord->mutex);
-  free(coord->mutex);
   free(coord);
 }
 
-//Return the next item that should be processed by this thread.
-//It is this function which is responsible for implementing the load
-//balancing algorithm, after the initial assignment.
+//Take the first chunk of thread id's range. Returns the virtual chunk
+//number, or DC_DONE if the range is empty.
+unsigned long take_chunk(Coordinator coord, int id)
+{
+  unsigned long long r;
+
+  do {
+    r = coord->range[id];
+    if (DC_LO(r) >= DC_HI(r)) return DC_DONE;
+  } while (!__sync_bool_compare_and_swap(coord->range + id, r,
+					 DC_RANGE(DC_LO(r) + 1, DC_HI(r))));
+  return DC_LO(r);
+}
+
+//Move the back half of the fullest other range into thread id's own
+//(empty) range. Returns 0 if there was nothing left to steal.
+int steal_chunks(Coordinator coord, int id)
+{
+  unsigned long long r;
+  unsigned long n,most,take;
+  int i,victim;
+
+  for (;;) {
+    victim = -1;
+    most = 0;
+    for (i = 0; i < coord->cpus; i++) {
+      if (i == id) continue;
+      r = coord->range[i];
+      n = DC_LO(r) < DC_HI(r) ? DC_HI(r) - DC_LO(r) : 0;
+      if (n > most) {
+	most = n;
+	victim = i;
+      }
+    }
+    if (victim == -1) return 0;
+    r = coord->range[victim];
+    if (DC_LO(r) >= DC_HI(r)) continue;
+    take = (DC_HI(r) - DC_LO(r) + 1) / 2;
+    if (__sync_bool_compare_and_swap(coord->range + victim, r,
+				     DC_RANGE(DC_LO(r), DC_HI(r) - take))) {
+      //nobody touches an empty range, so ours can simply be stored
+      coord->range[id] = DC_RANGE(DC_HI(r) - take, DC_HI(r));
+      __sync_synchronize();
+      return 1;
+    }
+  }
+}
+
+//Return the next item that should be processed by this thread, or
+//DC_DONE when the whole list has been handed out.
 unsigned long next_item(Coordinator coord, int id) {
   
-  int next_item;
-  int take;
-  
-  next_item = coord->next[id];
-  
-  if (next_item > coord->last[id]) {
-    pthread_mutex_lock(coord->mutex);
-    if (coord->reserve >= coord->list_size) {
-      pthread_mutex_unlock(coord->mutex);
-      return -1;
+  unsigned long v,c;
+
+  if (coord->lpo.cancel && *coord->lpo.cancel) return DC_DONE;
+  while (coord->next[id] >= coord->last[id]) {
+    v = take_chunk(coord,id);
+    if (v == DC_DONE) {
+      if (!steal_chunks(coord,id)) return DC_DONE;
+      continue;
     }
-    next_item = coord->reserve;
-    if (coord->finished < coord->cpus/2) 
-      take = (coord->list_size - coord->reserve) /
-	(coord->cpus - coord->finished);
-    else 
-      take = (coord->list_size - coord->reserve) / (coord->cpus/2);
-    take = take < 5 ? 5 : take; //no alloc less than 5 elements
-    coord->reserve += take;
-    coord->finished++;
-    pthread_mutex_unlock(coord->mutex);
-    coord->last[id] = next_item + take - 1;
-    coord->last[id] = min(coord->last[id],coord->list_size-1);
-    coord->next[id] = next_item;
-    coord->inc[id] = 1;
+    //virtual chunk v is the (v % per)th chunk of thread v / per
+    c = (v % coord->per) * coord->cpus + v / coord->per;
+    if (c >= coord->nchunks) continue;
+    coord->next[id] = c * coord->chunk;
+    coord->last[id] = min(coord->next[id] + coord->chunk, coord->list_size);
   }
-  
-  coord->next[id] += coord->inc[id];
-  
-  return next_item;
+  return coord->next[id]++;
 }
 
 
-//This is the entry point for each thread.
-void* dc_thread_action(void* ctmp)
+//This is what each thread of the pool runs.
+void dc_thread_action(void* ctmp, int myid)
 {
   Coordinator coord;
-  int myid = -1;
-  pthread_t mytid;
   unsigned long idx;
  
   coord = (Coordinator) ctmp;
-  mytid = pthread_self();
-  //figure out which one is calling this function
-    for (idx = 0; idx < coord->cpus; idx++) {
-      if (coord->tids[idx] == mytid) myid = idx;
-    }
   //loop unil next_item tells us we are done.
-    while((idx = next_item(coord,myid)) != -1) 
+  while((idx = next_item(coord,myid)) != DC_DONE) 
     coord->retlist[idx] =
       coord->action_func(coord->pdata,coord->context[myid],
 			 coord->list_data[idx]);
-  return NULL;
 }
 
 //This function processes the list if multiple processors are available.
 void** process_list_mt(Coordinator coord)
 {
-  int i;
-  void* toss;
-  void** ret;
-  
-  coord->tids[0] = pthread_self(); 
-  for (i = 1; i < coord->cpus; i++) 
-    pthread_create(coord->tids+i,NULL,dc_thread_action,coord);
-  
-  dc_thread_action(coord); //finally, main thread does it stuff
-
-  //wait for others to join
-   for (i = 1; i < coord->cpus; i++) 
-     pthread_join(coord->tids[i],&toss);
-
-  ret = coord->retlist;
-  return ret;
+  run_on_pool(dc_thread_action,coord,coord->cpus);
+  return coord->retlist;
 }
 
 //This function processes the list if there is only one processor.
 void** process_list_st(list_proc_obj lpo)
 { 
   unsigned long i;
-  void* scratch = NULL;
+  void** scratch;
   void** retlist;
   
   retlist = malloc_array(void*,lpo.list_size);
   
-  if (lpo.allocate_scratch_space)
-    scratch = lpo.allocate_scratch_space(lpo.shared);
+  scratch = get_scratch(lpo,1);
   for (i = 0; i < lpo.list_size; i++)
-    retlist[i] = lpo.process_item(lpo.shared,scratch,lpo.list[i]);
-  if (scratch) {
-    if (lpo.free_scratch_space) lpo.free_scratch_space(lpo.shared,scratch);
-    else free(scratch);
-  }
+    if (lpo.cancel && *lpo.cancel) retlist[i] = NULL;
+    else retlist[i] = lpo.process_item(lpo.shared,scratch[0],lpo.list[i]);
+  put_scratch(lpo,scratch,1);
   return retlist;
 }
 
@@ -224,24 +497,20 @@ void** process_list_st(list_proc_obj lpo)
  * The function process_list calls a specified function once for each
  * object appareing on a specified list. The results of calling this
  * function are placed in the returned array, in a position
- * corresponding to the placement of the original object. For each
- * processor available beyond the first an additional thread is
- * created and the work is shared between all threads. When all
- * objects on the given list have been processed, any additional
- * threads are cleaned up. No guareentess are made about the order in
+ * corresponding to the placement of the original object. The work is
+ * shared between the calling thread and the threads of the process
+ * wide pool (see run_on_pool), one thread per processor. A
+ * process_list called from inside another one runs in the calling
+ * thread alone. No guareentess are made about the order in
  * which items on the list will be processed, only that they will have
  * all been processed when this function returns.
  *
- * This function attempts to be smart about how items are handed out
- * to threads for processing, so that each thread keeps working until
- * the entire list is processed, while minimizing the number of mutex
- * locks that must take place. The current heuristic for achieving
- * this assumes that items which appear close to each other on the
- * list to be processed will require similiar amounts of computation
- * to process. For instance, perhaps the provided list has been sorted
- * so that items with longer required computation times appear at the
- * front of the list, with the expected computation time dropping as
- * you move down the list.
+ * Items are handed out in small chunks, threads that run out of work
+ * steal from those that still have some, so every thread keeps
+ * working until the entire list is processed however uneven the cost
+ * of items is. Threads start out working from the front of the list
+ * together, so if the list has been sorted with the most important
+ * items first those are processed first.
  *
  * @param lpo A list_proc_obj describing the list to be processed and
  * how to process it.
@@ -253,7 +522,7 @@ void**  process_list(list_proc_obj lpo) {
   Coordinator coord; int num_proc;
   void** ret;
   
-  num_proc = number_of_processors();
+  num_proc = pool_threads();
 
   if (num_proc == 1) ret = process_list_st(lpo);
   else {
@@ -290,5 +559,7 @@ list_proc_obj get_list_proc_obj(void** list, unsigned long size,void* shared,
   lpo.process_item = function;
   lpo.allocate_scratch_space = NULL;
   lpo.free_scratch_space = NULL;
+  lpo.cache_scratch = 0;
+  lpo.cancel = NULL;
   return lpo;
 }
@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "pmproblem.h"
+#include "transclass.h"
 #include "jadimg.h"
 
 // Usual error ranking of matches, with that added caveat that 
@@ -23,18 +24,31 @@
 //This allows the standard compare function to be a true compare,
 //and ensures we get propoer credit to the first trial when multiple
 //trials produce the same result.
-int sort_by_trial_num(const void* e1, const void* e2)
+int match_trial_order(Match m1, Match m2)
 {
 	int res;
-	Match* m1;
-	Match* m2;
 
-	res = compare_match(e1,e2);
+	res = match_order(m1,m2);
 	if (res) return res;
-	m1 = (Match*) e1;
-	m2 = (Match*) e2;
-	if ((*m1)->trial_num < (*m2)->trial_num) return -1;
-	return 1;
+	if (m1->trial_num < m2->trial_num) return -1;
+	if (m1->trial_num > m2->trial_num) return 1;
+	return 0;
+}
+
+int sort_by_trial_num(const void* e1, const void* e2)
+{
+	return match_trial_order(*((Match*) e1),*((Match*) e2));
+}
+
+//The number of results report_matches would find on the first n
+//entries of a sorted list, counting no further than want.
+int distinct_instances(Match* matches, int n, int want)
+{
+  int i, k = 0;
+
+  for (i = 0; i < n && k < want; i++)
+    if (i == 0 || !same_match_instance(matches[i],matches[i-1])) k++;
+  return k;
 }
 
 
@@ -80,7 +94,7 @@ IMG img_warp_by_pose(double* pose, IMG input,int rows, int cols)
     IMG output;
     int i,j;
     int tx,ty;
-    double denom;
+    double *x,*y,*wx,*wy;
     char* fill;
 
     output = img_alloc(rows,cols,0);
@@ -91,17 +105,30 @@ IMG img_warp_by_pose(double* pose, IMG input,int rows, int cols)
 	fill[i] = 0;
     } 
 
-    for (i = 0; i < input->rows; i++)
+    //warp a row of the input at a time
+    x = (double*) malloc(sizeof(double) * input->cols);
+    y = (double*) malloc(sizeof(double) * input->cols);
+    wx = (double*) malloc(sizeof(double) * input->cols);
+    wy = (double*) malloc(sizeof(double) * input->cols);
+    for (j = 0; j < input->cols; j++) x[j] = j;
+
+    for (i = 0; i < input->rows; i++) {
+	for (j = 0; j < input->cols; j++) y[j] = i;
+	transform_batch_projective(x,y,input->cols,pose,wx,wy);
 	for (j = 0; j < input->cols; j++) {
-	    denom = pose[6] * j + pose[7] * i + 1.0;
-	    tx = (pose[0] * j + pose[1] * i + pose[2])/denom;
-	    ty = (pose[3] * j + pose[4] * i + pose[5])/denom;
+	    tx = wx[j];
+	    ty = wy[j];
 	    if (tx < 0 || ty < 0) continue;
 	    if (tx >= cols || ty >= rows) continue;
 	    img_gray_pixel(output,tx,ty) = img_gray_pixel(input,j,i);
 	    fill[ty * cols + tx] = 1;
 	}
-   
+    }
+
+    free(x);
+    free(y);
+    free(wx);
+    free(wy);
     img_fillholes(output,fill);
     return output;
 }
@@ -162,7 +189,8 @@ void report_matches(PntMatchProblem problem,Match* matches, int trials)
       if (j > 0 && (j+1) % 3 == 0) printf("\n");
     }
     */
-    print_pose(problem->solution->pose,problem->pose_dim);
+    //proper_pose leaves the pose in projective form, whatever the class
+    print_pose(problem->solution->pose,PROJECTIVE);
     printf("\n\n");
 
 
@@ -193,7 +221,7 @@ void report_matches(PntMatchProblem problem,Match* matches, int trials)
       if (j > 0 && (j+1) % 3 == 0) printf("\n");
     }
     */
-    print_pose(matches[firsti]->pose,problem->pose_dim);
+    print_pose(matches[firsti]->pose,PROJECTIVE);
     printf("\n\n");
     
     /*
@@ -283,7 +311,8 @@ void report_matches_html(PntMatchProblem problem,Match* matches, int trials)
       img_free(nimg);
     }
     fprintf(fout,"</td><td>");
-    print_pose_html(fout,problem->solution->pose,problem->pose_dim);
+    //proper_pose leaves the pose in projective form, whatever the class
+    print_pose_html(fout,problem->solution->pose,PROJECTIVE);
     fprintf(fout,"</td></tr></table></center></p>");
     print_match_html(fout,problem->solution); 
   }
@@ -320,7 +349,7 @@ void report_matches_html(PntMatchProblem problem,Match* matches, int trials)
       img_free(nimg);   
     }
     fprintf(fout,"</td><td>");
-    print_pose_html(fout,matches[firsti]->pose,problem->pose_dim);
+    print_pose_html(fout,matches[firsti]->pose,PROJECTIVE);
     fprintf(fout,"</td></tr></table></center></p>");
     print_match_html(fout,matches[firsti]); 
     i++; k++;
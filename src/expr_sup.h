@@ -23,7 +23,9 @@ extern "C" {
 
   void report_matches(PntMatchProblem, Match*, int);
   void report_matches_html(PntMatchProblem, Match*, int);
+  int match_trial_order(Match, Match);
   int sort_by_trial_num(const void*, const void*);
+  int distinct_instances(Match*, int, int);
   IMG img_warp_by_pose(double*, IMG,int, int);
   IMG img_markpoints(PointSet, IMG);
 
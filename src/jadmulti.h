@@ -64,6 +64,21 @@ typedef struct {
    * then the standard free function will be called for each per-thread
    * object.
    **/
+
+  int cache_scratch;
+  /**< If set, the per-thread objects are kept after the list has been
+   * processed, and reused by later lists with the same shared block
+   * and allocate_scratch_space. The objects must then be safe to
+   * reuse, and flush_scratch_cache must be called before the shared
+   * block is freed. get_list_proc_obj sets this to 0.
+   **/
+
+  volatile int* cancel;
+  /**< If not NULL, processing stops once *cancel becomes non zero. Items
+   * not yet started are skipped, and their entries on the returned
+   * list are NULL. Items being processed at the time are finished (or
+   * can watch the flag themselves). get_list_proc_obj sets this to NULL.
+   **/
 } list_proc_obj;
 
 
@@ -77,6 +92,9 @@ extern "C" {
   list_proc_obj get_list_proc_obj(void**, unsigned long,void*,
 				  void* (*t)(void*,void*,void*));
   void qsort_2t(void*, size_t, size_t, int (*cmpfunc)(const void*,const void*));
+  int pool_threads(void);
+  void run_on_pool(void (*)(void*,int), void*, int);
+  void flush_scratch_cache(void*);
   
 #ifdef  __cplusplus
 }
@@ -11,6 +11,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
 #include "pmproblem.h"
 #include "jadutil.h"
 #include "jadmulti.h"
@@ -20,65 +22,44 @@
 //return list of lists, containing nearest neighbors for each point
 //each elements starts with the index of the point the others are nearest too
 //thus list[i][0] = i in all cases, list[i][1] is the closest point, list[i][2]
-//is second closest, and so on.
-short** pointset_neighbors(PointSet points, int num)
+//is second closest, and so on. Equally distant points are listed in index
+//order. The neighbors come from a grid over the set (see pntgrid.c),
+//so memory is linear in the size of the set.
+int** pointset_neighbors(PointSet points, int num)
 {
-  short** list;
-  //short** ulist;
+  int** list;
+  PointGrid grid;
   double* distance;
-  int i,j,k;
-  int size,best;
-  double low,high;
+  int i,j,got;
+  int size;
 
   size = points->size;
-  list = (short**) malloc(sizeof(short*) * size);
+  list = (int**) malloc(sizeof(int*) * size);
   for (i = 0; i < size; i++)
-    list[i] = (short*) malloc(sizeof(short) * num);
-
-  distance = (double*) malloc(sizeof(double) * size * size);
+    list[i] = (int*) malloc(sizeof(int) * num);
 
-  //build table of distances
-  for (i = 0; i < size; i++) {
-    distance[i * size + i] = 9e20;
-    for (j = 0; j < i; j++) {
-      low = points->x[i] - points->x[j];
-      distance[i * size + j] = low * low;
-      low = points->y[i] - points->y[j];
-      distance[i * size + j] += low * low;
-      distance[j * size + i] = distance[i * size + j];
-    }
-  }
+  grid = build_pointgrid(points,0.0);
+  distance = (double*) malloc(sizeof(double) * num);
 
   // for each point in the set
   for (i = 0; i < size; i++) {
     list[i][0] = i;
-    low = -8e20;
-    best = -1; //not strictly neccessary, surpresses warnings
-   // for each nearest point
-    for (j = 1; j < num; j++) {
-     high = 8e20;
-      // for each point in the set, again
-      for (k = 0; k < size; k++) {
-	if (i == k) continue;
-	if (distance[i*size+k] < high && distance[i*size+k] > low) {
-	  best = k;
-	  high = distance[i*size+k];
-	}
-      } //end k
-      list[i][j] = best;
-      low = high;
-    } //end j
-  } //end i
+    got = pointgrid_nearest(grid,points->x[i],points->y[i],num-1,i,
+			    list[i]+1,distance);
+    //too few points for a full cluster, pad with the last one found
+    for (j = got + 1; j < num; j++) list[i][j] = list[i][j-1];
+  }
 
   free(distance);
+  free_pointgrid(grid);
   return list;
 }
 
 //permutates clusters, holding the key point (clusters[i][0]) the same
-short** cluster_permutations(short** clusters, int numc, int csize,
+int** cluster_permutations(int** clusters, int numc, int csize,
 			     int* nperms)
 {
-  short** newlist;
+  int** newlist;
   int* plist;
   int** pmap;
   int numperm;
@@ -89,10 +70,10 @@ short** cluster_permutations(short** clusters, int numc, int csize,
   for (i = 0; i < csize-1; i++) plist[i] = i;
   pmap = permutations(plist,csize-1,&numperm);
   free(plist);
-  newlist = (short**) malloc(sizeof(short*) * numperm * numc);
+  newlist = (int**) malloc(sizeof(int*) * numperm * numc);
   for(i = 0; i < numc; i++) {
     for (j = 0; j < numperm; j++) {
-      newlist[listpos] = (short*) malloc(sizeof(short) * csize);
+      newlist[listpos] = (int*) malloc(sizeof(int) * csize);
       newlist[listpos][0] = clusters[i][0];
       for (k = 0; k < csize-1; k++) 
 	newlist[listpos][k+1] = clusters[i][pmap[j][k]+1];
@@ -137,25 +118,255 @@ Match* prune_match_list(Match* features, unsigned long* numf)
   return ufeat;
 }
 
-void* eval_list_wrapper(void* prb, void* scratch, void* item)
-{
-  context_handle* ch;
+//A key feature that has been scored but not built. Index is
+//mi * dc + dj, which is also the feature's position in the full
+//mc x dc list the old code materialized, and breaks ties in error
+//the same way the stable sort over that list did.
+typedef struct KFCandidateData {
+  double error;
+  unsigned long index;
+} KFCandidate;
+
+//Bounded max heap of candidates, worst on top. It grows as needed up
+//to limit, so a heap never holds more than min(limit, features seen).
+typedef struct KFHeapData {
+  KFCandidate* item;
+  unsigned long size;
+  unsigned long allocated;
+  unsigned long limit;
+} KFHeap;
+
+//shared block for streaming key features
+typedef struct KFStreamData {
   PntMatchProblem problem;
-  Match match;
+  int** model_cluster;
+  int** data_cluster;
+  int dc;
+  int pairs;
+  KFHeap best;
+  unsigned long nondegen;
+  pthread_mutex_t mutex;
+  //invariant prefilter, see kf_build_index. Unused if tol is 0.
+  double tol;
+  double* msig;
+  int* mdims;
+  double* dsig;
+  int* ddims;
+  KFCandidate* dkey; //data clusters with a signature, by first value
+  int nkey;
+  int* loose;        //data clusters without one, always scored
+  int nloose;
+} KFStream;
+
+//per-thread scratch for streaming key features
+typedef struct KFScratchData {
+  context_handle* ch;
+  MatchData feature;
+  KFHeap best;
+  unsigned long nondegen;
+} KFScratch;
 
-  ch = (context_handle*) scratch;
-  problem = (PntMatchProblem) prb;
-  match = (Match) item;
-  match->pose = ch->pose;
-  initial_context(problem,match,ch);
-  evaluate_match_with_partial(problem,match,10000.0,ch->partial);
+int kf_worse(KFCandidate* a, KFCandidate* b)
+{
+  if (a->error != b->error) return a->error > b->error;
+  return a->index > b->index;
+}
+
+int compare_kf_candidate(const void* a, const void* b)
+{
+  KFCandidate* ca = (KFCandidate*) a;
+  KFCandidate* cb = (KFCandidate*) b;
+  if (kf_worse(ca,cb)) return 1;
+  if (kf_worse(cb,ca)) return -1;
+  return 0;
+}
+
+void kf_heap_push(KFHeap* heap, double error, unsigned long index)
+{
+  KFCandidate c, t;
+  unsigned long i,j;
+
+  if (heap->limit == 0) return;
+  c.error = error;
+  c.index = index;
+  if (heap->size == heap->limit) {
+    if (!kf_worse(heap->item,&c)) return;
+    //replace the worst and sift down
+    i = 0;
+    for (;;) {
+      j = 2 * i + 1;
+      if (j >= heap->size) break;
+      if (j + 1 < heap->size && kf_worse(heap->item+j+1,heap->item+j)) j++;
+      if (!kf_worse(heap->item+j,&c)) break;
+      heap->item[i] = heap->item[j];
+      i = j;
+    }
+    heap->item[i] = c;
+    return;
+  }
+
+  if (heap->size == heap->allocated) {
+    heap->allocated = heap->allocated ? heap->allocated * 2 : 64;
+    if (heap->allocated > heap->limit) heap->allocated = heap->limit;
+    heap->item = (KFCandidate*) realloc(heap->item, sizeof(KFCandidate) *
+					heap->allocated);
+  }
+  i = heap->size++;
+  while (i > 0 && kf_worse(&c,heap->item+(i-1)/2)) {
+    t = heap->item[(i-1)/2];
+    heap->item[i] = t;
+    i = (i - 1) / 2;
+  }
+  heap->item[i] = c;
+}
+
+void* kf_scratch_alloc(void* shared)
+{
+  KFStream* kfs = (KFStream*) shared;
+  KFScratch* kf;
+
+  kf = (KFScratch*) malloc(sizeof(KFScratch));
+  kf->ch = (context_handle*) get_search_context(kfs->problem);
+  kf->feature.size = kfs->pairs;
+  kf->feature.allocated = 0;
+  kf->feature.pose = NULL;
+  kf->best.item = NULL;
+  kf->best.size = kf->best.allocated = 0;
+  kf->best.limit = kfs->best.limit;
+  kf->nondegen = 0;
+  return kf;
+}
+
+//folds a thread's candidates into the shared heap on the way out
+void kf_scratch_free(void* shared, void* scratch)
+{
+  KFStream* kfs = (KFStream*) shared;
+  KFScratch* kf = (KFScratch*) scratch;
+  unsigned long i;
+
+  pthread_mutex_lock(&kfs->mutex);
+  for (i = 0; i < kf->best.size; i++)
+    kf_heap_push(&kfs->best,kf->best.item[i].error,kf->best.item[i].index);
+  kfs->nondegen += kf->nondegen;
+  pthread_mutex_unlock(&kfs->mutex);
+
+  free(kf->best.item);
+  free_search_context(kfs->problem,kf->ch);
+  free(kf);
+}
+
+//scores one key feature and keeps it if it is good enough
+void kf_score(KFStream* kfs, KFScratch* kf, int mi, int j)
+{
+  Match match = &kf->feature;
+
+  match->m = kfs->model_cluster[mi];
+  match->d = kfs->data_cluster[j];
+  match->size = kfs->pairs;
+  match->pose = kf->ch->pose;
+  initial_context(kfs->problem,match,kf->ch);
+  evaluate_match_with_partial(kfs->problem,match,10000.0,kf->ch->partial);
   match->pose = NULL;
+  if (match->error > 10000.0) return;
+  kf->nondegen++;
+  kf_heap_push(&kf->best,match->error,(unsigned long) mi * kfs->dc + j);
+}
 
-  if (match->error > 10000.0) {
-    free_match(match);
-    match = NULL;
+//Compute the invariant signature of every cluster and index the data
+//clusters by the first value of theirs, so that kf_block_wrapper can
+//find the ones that might correspond to a model cluster with a binary
+//search. Clusters without a signature are never filtered out.
+void kf_build_index(KFStream* kfs, int mc)
+{
+  PntMatchProblem problem = kfs->problem;
+  int i;
+
+  kfs->msig = malloc_array(double,mc * PM_MAX_INVARIANT);
+  kfs->mdims = malloc_array(int,mc);
+  for (i = 0; i < mc; i++)
+    kfs->mdims[i] = problem->cluster_invariant(problem->model,
+					       kfs->model_cluster[i],
+					       kfs->pairs,
+					       kfs->msig + i * PM_MAX_INVARIANT);
+
+  kfs->dsig = malloc_array(double,kfs->dc * PM_MAX_INVARIANT);
+  kfs->ddims = malloc_array(int,kfs->dc);
+  kfs->dkey = malloc_array(KFCandidate,kfs->dc);
+  kfs->loose = malloc_array(int,kfs->dc);
+  kfs->nkey = kfs->nloose = 0;
+  for (i = 0; i < kfs->dc; i++) {
+    kfs->ddims[i] = problem->cluster_invariant(problem->data,
+					       kfs->data_cluster[i],
+					       kfs->pairs,
+					       kfs->dsig + i * PM_MAX_INVARIANT);
+    if (kfs->ddims[i] > 0) {
+      kfs->dkey[kfs->nkey].error = kfs->dsig[i * PM_MAX_INVARIANT];
+      kfs->dkey[kfs->nkey].index = i;
+      kfs->nkey++;
+    }
+    else kfs->loose[kfs->nloose++] = i;
   }
-  return match;
+  qsort_2t(kfs->dkey,kfs->nkey,sizeof(KFCandidate),compare_kf_candidate);
+}
+
+void kf_free_index(KFStream* kfs)
+{
+  free(kfs->msig);
+  free(kfs->mdims);
+  free(kfs->dsig);
+  free(kfs->ddims);
+  free(kfs->dkey);
+  free(kfs->loose);
+}
+
+//true if the signatures of model cluster mi and data cluster j agree to
+//within the tolerance in every value
+int kf_compatible(KFStream* kfs, int mi, int j)
+{
+  double* ms = kfs->msig + mi * PM_MAX_INVARIANT;
+  double* ds = kfs->dsig + j * PM_MAX_INVARIANT;
+  int k;
+
+  if (kfs->mdims[mi] != kfs->ddims[j]) return 1;
+  for (k = 1; k < kfs->mdims[mi]; k++)
+    if (fabs(ms[k] - ds[k]) > kfs->tol) return 0;
+  return 1;
+}
+
+//scores one model cluster against every data cluster, or with the
+//prefilter on, against those whose signatures are compatible
+void* kf_block_wrapper(void* shared, void* scratch, void* item)
+{
+  KFStream* kfs = (KFStream*) shared;
+  KFScratch* kf = (KFScratch*) scratch;
+  PntMatchProblem problem = kfs->problem;
+  int mi = *((int*) item);
+  int j,lo,hi,mid;
+  double key;
+
+  //a model cluster can take a while, so the deadline is checked as we go
+  if (kfs->tol <= 0.0 || kfs->mdims[mi] <= 0) {
+    for (j = 0; j < kfs->dc && !search_cancelled(problem); j++)
+      kf_score(kfs,kf,mi,j);
+    return NULL;
+  }
+
+  //first data cluster whose key is within the tolerance
+  key = kfs->msig[mi * PM_MAX_INVARIANT];
+  lo = 0; hi = kfs->nkey;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (kfs->dkey[mid].error < key - kfs->tol) lo = mid + 1;
+    else hi = mid;
+  }
+  for (; lo < kfs->nkey && kfs->dkey[lo].error <= key + kfs->tol; lo++) {
+    if (search_cancelled(problem)) return NULL;
+    j = kfs->dkey[lo].index;
+    if (kf_compatible(kfs,mi,j)) kf_score(kfs,kf,mi,j);
+  }
+  for (j = 0; j < kfs->nloose && !search_cancelled(problem); j++)
+    kf_score(kfs,kf,mi,kfs->loose[j]);
+  return NULL;
 }
 
 /**
@@ -184,23 +395,35 @@ void* eval_list_wrapper(void* prb, void* scratch, void* item)
  *          for clustering.  But this algorithm eats up memory, and
  *          trade offs must be made.
  *
- * NOTE : All key features are generated and sorted, regaurdless of
- * the value of want. Prunning the list is strictly a memory reduction
- * trick, and does not effect performance (at least at this stage).
+ * NOTE : All key features are scored, regaurdless of the value of
+ * want, but they are never all held at once. Each model cluster is
+ * scored against every data cluster as one work item, and each thread
+ * keeps only the best features it has seen in a heap bounded by the
+ * number that can be returned. The heaps are merged at the end and only
+ * the winners are built as matches. Memory is O(want) rather than
+ * O(mc*dc), except for want == 0 (and -1, which is half the list),
+ * where the bound is the number of non-degenerate features.
+ *
+ * If the problem sets an invariant tolerance and the transformation
+ * class has a cluster_invariant, pairs of clusters whose signatures
+ * disagree are never scored, and do not count toward got.
  */
 
 Match* key_features(PntMatchProblem problem, int pairs, long want,
 		    unsigned long* got)
 {
   list_proc_obj lpo;
-  short** model_cluster;
-  short** data_cluster;
-  int mc, dc;
-  Match* features;
+  KFStream kfs;
+  KFCandidate* cand;
+  int** model_cluster;
+  int** data_cluster;
+  int* blocks;
+  void** blist;
+  int mc, dc, ms;
   Match* flist;
   Match curf;
-  int i,j;
-  int tf;
+  unsigned long tf,i;
+  int mi,dj,k;
 
   //find nearest neighbors for both madel and data
   model_cluster = pointset_neighbors(problem->model,pairs);
@@ -214,68 +437,78 @@ Match* key_features(PntMatchProblem problem, int pairs, long want,
   else
     data_cluster = cluster_permutations(data_cluster,dc,pairs,&dc);
 
-  //allocate space for key features
-  tf = mc * dc;
-  features = (Match*) malloc(sizeof(Match) * tf);
-  for (i = 0; i < tf; i++)
-    features[i] = (Match) malloc(sizeof(MatchData));
-
-  //construct the key features
-  for (i = 0; i < mc; i++)
-    for (j = 0; j < dc; j++) {
-      curf = features[i*dc+j];
-      curf->m = model_cluster[i];
-      curf->d = data_cluster[j];
-      curf->size = pairs;
-      curf->allocated = 0;
-      curf->pose = NULL;
-    }
-  //evaluate all features, using multiple processors if possible
-  lpo = get_list_proc_obj((void**)features,tf,
-			  (void*) problem,eval_list_wrapper);
-  lpo.allocate_scratch_space = get_search_context;
-  lpo.free_scratch_space = free_search_context;
-  flist = (Match*) process_list(lpo);
-  free(features); features = flist;
-  //sort the list
-  qsort_2t(features,tf,sizeof(Match),compare_match);
-
-  //figure out where the cut off from prunning degen mathes is
-  i = tf/2;
-  while (i < tf && features[i]) i += max(((tf - i) / 2),1);
-  if (i != tf) { 
-    while(i >= 0 && !features[i]) i -= 5;
-    while (features[i]) i++;
+  //the most features that can come back. When want is -1 or 0 this
+  //can only be cut down to the non-degenerate count after the fact.
+  tf = (unsigned long) mc * dc;
+  kfs.best.limit = tf;
+  if (want == -1) kfs.best.limit = tf * 0.5;
+  else if (want > 0 && (unsigned long) want < tf) kfs.best.limit = want;
+  kfs.best.item = NULL;
+  kfs.best.size = kfs.best.allocated = 0;
+  kfs.problem = problem;
+  kfs.model_cluster = model_cluster;
+  kfs.data_cluster = data_cluster;
+  kfs.dc = dc;
+  kfs.pairs = pairs;
+  kfs.nondegen = 0;
+  pthread_mutex_init(&kfs.mutex,NULL);
+  kfs.tol = problem->cluster_invariant ? problem->invariant : 0.0;
+  if (kfs.tol > 0.0) kf_build_index(&kfs,mc);
+
+  //score all features, one model cluster per work item, using multiple
+  //processors if possible. The scratch is not cached, since freeing it
+  //is what hands each thread's best features back.
+  blocks = malloc_array(int,mc);
+  blist = malloc_array(void*,mc);
+  for (mi = 0; mi < mc; mi++) {
+    blocks[mi] = mi;
+    blist[mi] = blocks + mi;
   }
-  *got = i;
- 
+  lpo = get_list_proc_obj(blist,mc,(void*) &kfs,kf_block_wrapper);
+  lpo.allocate_scratch_space = kf_scratch_alloc;
+  lpo.free_scratch_space = kf_scratch_free;
+  lpo.cancel = &problem->cancel;
+  free(process_list(lpo));
+  free(blist);
+  free(blocks);
+  pthread_mutex_destroy(&kfs.mutex);
+  if (kfs.tol > 0.0) kf_free_index(&kfs);
+  *got = kfs.nondegen;
+
   //if want == -1 set heuristic number of trials
   //current heuristic is the top half of the list
   if (want == -1) want = min(*got,tf * 0.5);
   else if (want == 0) want = *got;
   else if (want > *got) want = *got;
-  flist = (Match*) malloc(sizeof(Match) * want);
 
-  //we expand each match, because expanding causes the match to
-  //get its own copy of the pairings; prior to this we are simply
-  //pointing to the clusters from earlier, and many matches share
-  //there clusters.
-  for (i = 0; i < want; i++) {
-    expand_match(features[i],problem->model->size);
-    flist[i] = features[i];
-    flist[i]->trial_num = i;
+  //the heap holds the best min(limit, got) features, which is want
+  cand = kfs.best.item;
+  qsort_2t(cand,kfs.best.size,sizeof(KFCandidate),compare_kf_candidate);
+
+  //each feature gets its own copy of the pairings, in expanded form
+  ms = problem->model->size;
+  flist = (Match*) malloc(sizeof(Match) * want);
+  for (i = 0; i < (unsigned long) want; i++) {
+    mi = cand[i].index / dc;
+    dj = cand[i].index % dc;
+    curf = allocate_match(ms);
+    for (k = 0; k < ms; k++) {
+      curf->m[k] = k;
+      curf->d[k] = -1;
+    }
+    for (k = 0; k < pairs; k++)
+      curf->d[model_cluster[mi][k]] = data_cluster[dj][k];
+    curf->size = ms;
+    curf->error = cand[i].error;
+    curf->trial_num = i;
+    flist[i] = curf;
   }
 
-  for (i = want; i < *got; i++) 
-    free_match(features[i]);
-    
+  free(cand);
   free_list((void**)model_cluster,mc);
   free_list((void**)data_cluster,dc);
-  free(features);
 
   *got = want;
-
-  //printf("end of kf\n");
   return flist;
 }
 
@@ -310,7 +543,7 @@ Match* improved_key_features(PntMatchProblem problem, int pairs, long want,
 {
   Match* tlist;
   Match* flist;
-  int i;
+  unsigned long i,n,k,unique;
   list_proc_obj lpo;
 
   //generate key features, return all non-degenerate features
@@ -327,20 +560,31 @@ Match* improved_key_features(PntMatchProblem problem, int pairs, long want,
   lpo = get_list_proc_obj((void**)tlist,*got,(void*) problem,onestep_wrapper);
   lpo.allocate_scratch_space = get_search_context;
   lpo.free_scratch_space = free_search_context;
+  lpo.cache_scratch = 1;
   flist = (Match*) process_list(lpo);
-  //process_list((void**)tlist,*got,(void*)problem,problem->context_alloc,
-  //	       onestep_wrapper);
-  //sort em
-  qsort_2t(flist,*got,sizeof(Match),compare_match);
-  
+  free(tlist);
+
+  //Only the best want unique features need to come out in order.
+  //Degenerate features come back NULL and rank last, and duplicates
+  //rank next to each other and are pruned, so keep asking for more of
+  //the list until enough unique ones are in order.
+  n = *got;
+  k = want > 0 ? min(n,2 * want) : n;
+  for (;;) {
+    best_matches(flist,n,k,match_order);
+    for (i = unique = 0; i < k && flist[i]; i++)
+      if (i == 0 || match_order(flist[i-1],flist[i])) unique++;
+    if (k == n || unique >= (unsigned long) want) break;
+    k = min(n,2 * k);
+  }
+  //everything past k ranks below what is kept
+  for (i = k; i < n; i++) free_match(flist[i]);
+
   //adjust got according to match what we have after
   //null entries are pruned. Remember, we prune
   //an entry if it is still "degenerate" after one pass
   //of local search
-  i = *got/2;
-  while (i < *got && flist[i]) i += max(((*got - i) / 2) ,1);
-  if (i != *got) while(i >= 0 && !flist[i]) i -= 5;
-  while (i < *got && flist[i]) i++;
+  for (i = 0; i < k && flist[i]; i++);
   *got = i;
   flist = prune_match_list(flist,got);
   printf("Got %lu unique features after one-step.\n",*got);
@@ -0,0 +1,158 @@
+/**
+ * @file ldl8.c
+ * @author Jason Denton
+ * @version 0.95
+ * @date May, 2009
+ *
+ * Copyright Jason Denton, 2009. This source code is made
+ * available under the terms of the new BSD license. See the file
+ * license.txt for the applicable terms.
+ **/
+
+/* LDL' factorization of an 8x8 symmetric positive definite matrix, with
+   rank one update and downdate. This is the companion of solvps8 for
+   local search, where the normal matrix changes by a pair at a time.
+   Updating a factor is O(n^2) and needs no square roots, against O(n^3)
+   and n square roots for factoring from scratch.
+
+   A factor is 72 doubles. The first 64 are an 8x8 matrix whose strict
+   lower triangle holds the unit lower triangular L, row major, and
+   whose diagonal holds D. The upper triangle is unused. The last 8 hold
+   1/D, so that solving takes no divisions.
+
+   The _batch versions do the same work on PM_BATCH independent factors
+   at once. Their arrays are interleaved, element e of lane k at
+   [e*PM_BATCH+k], so every inner loop runs across the lanes and is
+   vectorized by the compiler. */
+
+#include "pmproblem.h"
+
+//A pivot that shrinks by more than this factor during a downdate has
+//lost most of its significant digits. The factor is declared bad and
+//the caller goes back to solvps8.
+#define LDL8_KEEP 1e-8
+
+/*
+ * Factor the lower triangle of the 8x8 matrix M into F.
+ *
+ * return : 1 on success, 0 if M is not safely positive definite.
+ */
+int ldl8_factor(double* M, double* F)
+{
+  int i,j,k;
+  double d,t;
+
+  for (j = 0; j < 8; j++) {
+    d = M[j*9];
+    for (k = 0; k < j; k++) d -= F[j*8+k] * F[j*8+k] * F[k*9];
+    if (!(d > LDL8_KEEP * M[j*9])) return 0; //also catches NaN
+    F[j*9] = d;
+    F[64+j] = 1.0 / d;
+    for (i = j + 1; i < 8; i++) {
+      t = M[i*8+j];
+      for (k = 0; k < j; k++) t -= F[i*8+k] * F[j*8+k] * F[k*9];
+      F[i*8+j] = t * F[64+j];
+    }
+  }
+  return 1;
+}
+
+/*
+ * Replace the factor of A in F by the factor of A + alpha w w'.
+ * Alpha is normally 1 (update) or -1 (downdate). W is destroyed.
+ *
+ * return : 1 on success, 0 if the result is not positive definite or
+ *          has lost too much precision. F is garbage after a failure,
+ *          so work on a copy when failure is a possibility.
+ */
+int ldl8_update(double* F, double* w, double alpha)
+{
+  int i,j;
+  double p,d,dn,inv,beta;
+
+  for (j = 0; j < 8; j++) {
+    p = w[j];
+    if (p == 0.0) continue; //nothing changes in this column
+    d = F[j*9];
+    dn = d + alpha * p * p;
+    if (!(dn > LDL8_KEEP * d)) return 0;
+    inv = 1.0 / dn;
+    beta = p * alpha * inv;
+    alpha *= d * inv;
+    F[j*9] = dn;
+    F[64+j] = inv;
+    for (i = j + 1; i < 8; i++) {
+      w[i] -= p * F[i*8+j];
+      F[i*8+j] += beta * w[i];
+    }
+  }
+  return 1;
+}
+
+/*
+ * Solve (L D L') x = b for x, given the factor F. The solution replaces b.
+ */
+void ldl8_solve(double* F, double* b)
+{
+  int i,k;
+
+  for (i = 1; i < 8; i++)
+    for (k = 0; k < i; k++) b[i] -= F[i*8+k] * b[k];
+  for (i = 0; i < 8; i++) b[i] *= F[64+i];
+  for (i = 6; i >= 0; i--)
+    for (k = i + 1; k < 8; k++) b[i] -= F[k*8+i] * b[k];
+}
+
+/*
+ * ldl8_update on PM_BATCH interleaved factors. A column is skipped only
+ * if it is zero in every lane. Lanes that fail have ok[k] cleared and
+ * are left as garbage; the other lanes are unaffected.
+ */
+void ldl8_update_batch(double* F, double* w, double alpha, int* ok)
+{
+  int i,j,k,any;
+  double a[PM_BATCH], beta[PM_BATCH];
+  double d,dn,inv;
+
+  for (k = 0; k < PM_BATCH; k++) a[k] = alpha;
+  for (j = 0; j < 8; j++) {
+    any = 0;
+    for (k = 0; k < PM_BATCH; k++) any |= (w[j*PM_BATCH+k] != 0.0);
+    if (!any) continue;
+    for (k = 0; k < PM_BATCH; k++) {
+      d = F[j*9*PM_BATCH+k];
+      dn = d + a[k] * w[j*PM_BATCH+k] * w[j*PM_BATCH+k];
+      ok[k] &= (dn > LDL8_KEEP * d);
+      inv = 1.0 / dn;
+      beta[k] = w[j*PM_BATCH+k] * a[k] * inv;
+      a[k] *= d * inv;
+      F[j*9*PM_BATCH+k] = dn;
+      F[(64+j)*PM_BATCH+k] = inv;
+    }
+    for (i = j + 1; i < 8; i++)
+      for (k = 0; k < PM_BATCH; k++) {
+	w[i*PM_BATCH+k] -= w[j*PM_BATCH+k] * F[(i*8+j)*PM_BATCH+k];
+	F[(i*8+j)*PM_BATCH+k] += beta[k] * w[i*PM_BATCH+k];
+      }
+  }
+}
+
+/*
+ * ldl8_solve on PM_BATCH interleaved factors and right hand sides.
+ */
+void ldl8_solve_batch(double* F, double* b)
+{
+  int i,k,l;
+
+  for (i = 1; i < 8; i++)
+    for (k = 0; k < i; k++)
+      for (l = 0; l < PM_BATCH; l++)
+	b[i*PM_BATCH+l] -= F[(i*8+k)*PM_BATCH+l] * b[k*PM_BATCH+l];
+  for (i = 0; i < 8; i++)
+    for (l = 0; l < PM_BATCH; l++)
+      b[i*PM_BATCH+l] *= F[(64+i)*PM_BATCH+l];
+  for (i = 6; i >= 0; i--)
+    for (k = i + 1; k < 8; k++)
+      for (l = 0; l < PM_BATCH; l++)
+	b[i*PM_BATCH+l] -= F[(k*8+i)*PM_BATCH+l] * b[k*PM_BATCH+l];
+}
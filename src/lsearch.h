@@ -15,10 +15,22 @@
 
 #include "pmproblem.h"
 
+//a model/data pair within sigma of each other, see closest_match_pairs
+typedef struct {
+  double dist;
+  int m;
+  int d;
+} RansacPair;
+
 typedef struct {
   char* mtaken;
   char* dtaken;
-  double** dist_table;
+  int* near;
+  RansacPair* cand;
+  int cand_alloc;
+  int screen;         //preemptive test points for the next hypothesis
+  unsigned int seed;  //picks them, see ransac_screen
+  int rejected;       //the last hypothesis failed the screen
   PointSet trset;
   context_handle* ch;
 } RansacContext;
@@ -37,8 +49,11 @@ extern "C" {
   void* init_ransac_context(void*);
   void free_ransac_context(void*, void*);
   int ransac_actual(PntMatchProblem,RansacContext*,Match, Match);
+  int ransac_screen(PntMatchProblem,RansacContext*,Pose,int);
   int iransac_actual(PntMatchProblem,RansacContext*,Match, Match);
+  double ransac_trials_for_pairs(PntMatchProblem, double, double);
   unsigned long expected_ransac_trials(PntMatchProblem, double);
+  void note_ransac_trial(PntMatchProblem, Match);
   //short** stable_clusters(PointSet, int);
 
 #ifdef __CPLUSPLUS
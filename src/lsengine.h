@@ -0,0 +1,875 @@
+/**
+ * @file lsengine.h
+ * @author Jason Denton
+ * @version 0.95
+ * @date May, 2009
+ *
+ * Copyright Jason Denton, 2009. This source code is made
+ * available under the terms of the new BSD license. See the file
+ * license.txt for the applicable terms.
+ **/
+
+// The local search engine: context building, fitting error, incremental
+// evaluation and the search steps themselves. This is a template, not an
+// ordinary header. lsearch.c includes it once per transformation class,
+// with the macros below defined, to get a copy of the engine in which
+// the class functions are called directly and the context size is a
+// constant the compiler can unroll and vectorize loops over. One more
+// copy, the generic engine, goes through the function pointers of the
+// problem and serves any class without its own. No include guard, on
+// purpose, and every parameter is undefined again at the end.
+//
+// LS_NAME(f)             name of function f in this copy
+// LS_CONTEXT_SIZE        problem->context_size
+// LS_POSE_DIM            problem->pose_dim
+// LS_FACTOR_SIZE         problem->factor_size, 0 for no factored solution
+// LS_BATCHED             nonzero if the class has the PM_BATCH kernels
+// LS_TRANSFORM_POINTS(x,y,n,pose,tx,ty)   see transform_points
+// LS_TRANSFORM_POINTS_FLOAT(x,y,n,pose,tx,ty)   see transform_points_float
+// LS_TRANSFORM, LS_CONTEXT_FOR_PAIR, LS_POSE_FROM_PARTIAL, LS_DEGENERACY,
+// LS_POSE_SHIFT, LS_FACTOR_FROM_PARTIAL, LS_FACTOR_PAIR,
+// LS_POSE_FROM_FACTOR, LS_CONTEXT_BATCH, LS_POSE_BATCH
+//                        the class functions. These are only called
+//                        where the problem would have had them, so a
+//                        class without factors or batches can pass the
+//                        problem's (NULL) pointers.
+
+//Given a problem, match, and context object, this routine fills out the
+//context and prepares it for use in determining pose.
+int LS_NAME(initial_context)(PntMatchProblem problem, Match sol,
+			     context_handle* ch)
+{
+  int i,j;
+
+  ch->pairs = 0;
+  //build the initial context
+  for(i = 0; i < LS_CONTEXT_SIZE; i++)
+    ch->partial[i] = 0.0;
+  for (i = 0; i < BITSET_WORDS(problem->data->size); i++)
+    ch->paired[i] = 0;
+  for (i = 0; i < sol->size; i++) {
+    if (sol->d[i] == -1) continue;
+    ch->pairs++;
+    BIT_SET(ch->paired,sol->d[i]);
+    LS_CONTEXT_FOR_PAIR(problem->model->x[sol->m[i]],
+			      problem->model->y[sol->m[i]],
+			      problem->data->x[sol->d[i]],
+			      problem->data->y[sol->d[i]],
+			      ch->scratch);
+    for(j = 0; j < LS_CONTEXT_SIZE; j++)
+      ch->partial[j] += ch->scratch[j];
+  }
+  return ch->pairs;
+}
+
+/* Evaulte a the fit of a solution, and return the error in the
+   fit. Model should be a transformed version of the model, not the
+   original.  Terminates when error exceeeds current best. */
+
+double LS_NAME(fitting_error)(PntMatchProblem problem, Match match,
+			      double best)
+{
+  double err = 0.0;
+  int pairings = 0;
+  int dp,i,j,k,n;
+  double t1,t2;
+  double tmp;
+  double mx[PM_FIT_BLOCK], my[PM_FIT_BLOCK];
+  double tx[PM_FIT_BLOCK], ty[PM_FIT_BLOCK];
+
+  PointSet model;
+  PointSet data;
+
+  //grab and store model/data sets. save repeated offset from problem
+  model = problem->model;
+  data = problem->data;
+
+  for (i = 0; i < match->size; i = j) {
+    //ok, lazy transform
+    //we transform only points in the match, a block of them at a time
+    for (j = i, n = 0; j < match->size && n < PM_FIT_BLOCK; j++) {
+      if (match->d[j] == -1) continue;
+      mx[n] = model->x[match->m[j]];
+      my[n] = model->y[match->m[j]];
+      n++;
+    }
+    LS_TRANSFORM_POINTS(mx,my,n,match->pose,tx,ty);
+
+    for (k = i, n = 0; k < j; k++) {
+      // grab and store model/data pair
+      dp = match->d[k];
+      if (dp == -1) {
+	best -= 1.0;
+	continue; // skip if model point not paired
+      }
+
+      //compute additional fitting error on this point, and to sum
+      t1 = tx[n] - data->x[dp]; t1 *= t1;
+      t2 = ty[n] - data->y[dp]; t2 *= t2;
+      n++;
+      tmp = t1 + t2;
+      if (problem->cost) tmp = robust_cost(problem,tmp);
+      err += tmp;
+      best -= (tmp / problem->sigma);
+
+      //bail if we know we've exceed our bounds
+      //we return max penalty to signal that we did not do a full eval
+
+      if (best < 0.0) return BAD_MATCH_PENALTY;
+      pairings++; //count this pair
+    }
+  }
+  //don't check # pairings here to ensure valid pose, now done in pose
+  //routines as it should
+  return (err/problem->sigma) + ((double) (model->size - pairings));
+}
+
+//fitting_error in single precision, from the float copies of the
+//points, for precision=mixed. Close enough to rank the moves of a
+//step, but the move taken is always scored again in double, see
+//confirm_move. Since it need not match fitting_error to the last bit,
+//it is laid out for speed instead. Match must be expanded, as it is in
+//local search, so each block of model points can be transformed
+//straight from the float copy, paired or not, and only the data points
+//need gathering. With the quadratic cost the error is checked against
+//best once a block rather than once a pair. Every pair adds to the
+//error, so that gives up on the same matches.
+double LS_NAME(fitting_error_float)(PntMatchProblem problem, Match match,
+				    double best)
+{
+  float tx[PM_FIT_BLOCK], ty[PM_FIT_BLOCK];
+  float r[PM_FIT_BLOCK];
+  double err = 0.0;
+  double scale = 1.0 / problem->sigma;
+  int unpaired = 0;
+  int dp,i,k,n,p,pairs;
+  float t1,t2,sum;
+
+  for (i = 0; i < match->size; i += n) {
+    n = match->size - i < PM_FIT_BLOCK ? match->size - i : PM_FIT_BLOCK;
+    for (k = 0, pairs = 0; k < n; k++) pairs += match->d[i+k] != -1;
+    unpaired += n - pairs;
+    if (pairs == 0) continue;
+
+    LS_TRANSFORM_POINTS_FLOAT(problem->model_fx + i,problem->model_fy + i,n,
+			      match->pose,tx,ty);
+    //unpaired points are measured against data point 0 and then dropped
+    for (k = 0; k < n; k++) {
+      p = match->d[i+k] != -1;
+      dp = p ? match->d[i+k] : 0;
+      t1 = tx[k] - problem->data_fx[dp];
+      t2 = ty[k] - problem->data_fy[dp];
+      r[k] = p ? t1 * t1 + t2 * t2 : 0.0f;
+    }
+
+    if (problem->cost) {
+      //the robust costs are dear, so stop as soon as possible
+      for (k = 0; k < n; k++) {
+	if (r[k] == 0.0f) continue;
+	err += robust_cost(problem,r[k]);
+	if (err * scale + unpaired > best) return BAD_MATCH_PENALTY;
+      }
+    }
+    else {
+      for (k = 0, sum = 0.0f; k < n; k++) sum += r[k];
+      err += sum;
+      if (err * scale + unpaired > best) return BAD_MATCH_PENALTY;
+    }
+  }
+  return err * scale + unpaired;
+}
+
+//The fitting error evaluate_move ranks moves by.
+double LS_NAME(move_error)(PntMatchProblem problem, Match match,
+			   double best)
+{
+  if (problem->mixed)
+    return LS_NAME(fitting_error_float)(problem,match,best);
+  return LS_NAME(fitting_error)(problem,match,best);
+}
+
+//Fills the residual cache in ch for the match sol, using the pose of
+//the current partial context. The reference pose is left in
+//ch->extra_pose. Call once per local search step, after the context
+//is up to date and before trying any moves. Sol must be expanded.
+void LS_NAME(cache_residuals)(PntMatchProblem problem, Match sol,
+			      context_handle* ch)
+{
+  int i,n = 0;
+  double tx,ty,t1,t2;
+
+  LS_POSE_FROM_PARTIAL(ch->partial,ch->extra_pose);
+  ch->cached = 0;
+  //the residual bound is for the quadratic cost only
+  if (!problem->pose_shift || problem->cost ||
+      ch->pairs < problem->min_pairs) return;
+
+  for (i = 0; i < sol->size; i++) {
+    if (sol->d[i] == -1) {
+      ch->resid[i] = -1.0;
+      continue;
+    }
+    tx = problem->model->x[sol->m[i]];
+    ty = problem->model->y[sol->m[i]];
+    LS_TRANSFORM(&tx,&ty,ch->extra_pose);
+    t1 = tx - problem->data->x[sol->d[i]]; t1 *= t1;
+    t2 = ty - problem->data->y[sol->d[i]]; t2 *= t2;
+    ch->resid[i] = sqrt(t1 + t2);
+    ch->rsorted[n++] = ch->resid[i];
+  }
+  
+  //suffix sums of the sorted residuals and their squares, so the sum
+  //over all residuals beyond any D is an O(1) lookup after a search
+  qsort(ch->rsorted,n,sizeof(double),compare_residual);
+  ch->rsum[n] = 0.0;
+  ch->rsum2[n] = 0.0;
+  for (i = n - 1; i >= 0; i--) {
+    ch->rsum[i] = ch->rsum[i+1] + ch->rsorted[i];
+    ch->rsum2[i] = ch->rsum2[i+1] + ch->rsorted[i] * ch->rsorted[i];
+  }
+  ch->cached = n;
+}
+
+//The rounds of iteratively reweighted least squares, for the robust
+//costs. Starting from match->pose, each round weights the context of
+//every pair by robust_weight of its residual under the pose so far, and
+//solves again, so pairs the cost has given up on stop dragging the
+//pose. Stops early if too few pairs keep any weight or the solve breaks
+//down. The last pose solved is left in ch->wpose. If weight is not
+//NULL it needs room for twice match->size values, and the first half is
+//left holding the weights that pose was solved with.
+//
+//return : The number of rounds that gave a pose, 0 if none did.
+int LS_NAME(irls_reweight)(PntMatchProblem problem, Match match,
+			   context_handle* ch, double* weight)
+{
+  double* wp = ch->wpartial;
+  double* sc = ch->wscratch;
+  Pose cur = match->pose;
+  double tx,ty,t1,t2,w;
+  int it,i,j,used;
+
+  for (it = 0; it < problem->irls; it++) {
+    for (j = 0; j < LS_CONTEXT_SIZE; j++) wp[j] = 0.0;
+    used = 0;
+    for (i = 0; i < match->size; i++) {
+      if (weight) weight[match->size + i] = 0.0;
+      if (match->d[i] == -1) continue;
+      tx = problem->model->x[match->m[i]];
+      ty = problem->model->y[match->m[i]];
+      LS_TRANSFORM(&tx,&ty,cur);
+      t1 = tx - problem->data->x[match->d[i]]; t1 *= t1;
+      t2 = ty - problem->data->y[match->d[i]]; t2 *= t2;
+      w = robust_weight(problem,t1 + t2);
+      if (weight) weight[match->size + i] = w;
+      if (w <= 0.0) continue;
+      used++;
+      LS_CONTEXT_FOR_PAIR(problem->model->x[match->m[i]],
+			  problem->model->y[match->m[i]],
+			  problem->data->x[match->d[i]],
+			  problem->data->y[match->d[i]],sc);
+      for (j = 0; j < LS_CONTEXT_SIZE; j++) wp[j] += w * sc[j];
+    }
+    if (used < problem->min_pairs) break;
+    LS_POSE_FROM_PARTIAL(wp,ch->wpose);
+    for (j = 0; j < LS_POSE_DIM; j++)
+      if (!(fabs(ch->wpose[j]) < 1e100)) break; //also catches NaN
+    if (j < LS_POSE_DIM) break;
+    cur = ch->wpose;
+    if (weight) memcpy(weight,weight + match->size,
+		       sizeof(double) * match->size);
+  }
+  return it;
+}
+
+//Refine the pose of match by irls_reweight. The refined pose replaces
+//match->pose only if it does better than err, the error under the pose
+//match came with. With exact set it is scored by fitting_error, as
+//confirm_move needs, otherwise by move_error.
+//
+//return : The error of match under whichever pose it is left with.
+double LS_NAME(irls_pose)(PntMatchProblem problem, Match match,
+			  context_handle* ch, double err, int exact)
+{
+  Pose keep = match->pose;
+  double e;
+
+  if (!LS_NAME(irls_reweight)(problem,match,ch,NULL)) return err;
+
+  match->pose = ch->wpose;
+  e = LS_DEGENERACY(problem->model,ch->wpose,problem->scale);
+  if (e < err)
+    e += exact ? LS_NAME(fitting_error)(problem,match,err - e) :
+      LS_NAME(move_error)(problem,match,err - e);
+  match->pose = keep;
+  if (!(e < err)) return err;
+  memcpy(keep,ch->wpose,sizeof(double) * LS_POSE_DIM);
+  return e;
+}
+
+//As evaluate_move_with_partial, for a match whose pose has already
+//been solved for and placed in match->pose.
+double LS_NAME(evaluate_move)(PntMatchProblem problem, Match match,
+			      double best, context_handle* ch, int idx)
+{
+  double bound, shift;
+  int pairs;
+
+  match->error = LS_DEGENERACY(problem->model,match->pose,
+				     problem->scale);
+
+  if (match->error > best) return match->error;
+  if (!ch->cached) {
+    match->error += LS_NAME(move_error)(problem,match,best - match->error);
+    //only a move that would be taken is worth refining
+    if (problem->irls && problem->cost && match->error < best)
+      match->error = LS_NAME(irls_pose)(problem,match,ch,match->error,0);
+    return match->error;
+  }
+
+  //every unpaired model point costs one, whatever the pose
+  pairs = ch->pairs - (ch->resid[idx] >= 0.0) + (match->d[idx] != -1);
+  bound = match->error + (double) (problem->model->size - pairs);
+  
+  if (bound < best) {
+    shift = LS_POSE_SHIFT(problem->model,ch->extra_pose,match->pose);
+    if (shift < 1e100) { //also false for NaN
+      shift *= 1.0 + 1e-9;
+      bound += residual_bound(ch,shift,idx) / problem->sigma;
+    }
+  }
+
+  if (bound >= best) {
+    match->error += BAD_MATCH_PENALTY;
+    return match->error;
+  }
+  
+  best -= match->error;
+  match->error += LS_NAME(move_error)(problem,match,best);
+  return match->error;
+}
+
+//For precision=mixed, where a step ranks its moves in float. Scores the
+//move it picked, pairing model point i to dp (or unpairing it if dp is
+//-1), in double, from a pose solved from the full context. Ch->partial
+//must hold the context of sol without the move. Sol is left as it was,
+//apart from its pose.
+//
+//return : The error of sol with the move made, more than best if it
+//is no better than that.
+double LS_NAME(confirm_move)(PntMatchProblem problem, Match sol,
+			     context_handle* ch, int i, int dp, double best)
+{
+  double* wp = ch->wpartial;
+  int orig_dp = sol->d[i];
+  double err;
+  int j;
+
+  memcpy(wp,ch->partial,sizeof(double) * LS_CONTEXT_SIZE);
+  if (orig_dp != -1) {
+    LS_CONTEXT_FOR_PAIR(problem->model->x[i],problem->model->y[i],
+			problem->data->x[orig_dp],problem->data->y[orig_dp],
+			ch->wscratch);
+    for (j = 0; j < LS_CONTEXT_SIZE; j++) wp[j] -= ch->wscratch[j];
+  }
+  if (dp != -1) {
+    LS_CONTEXT_FOR_PAIR(problem->model->x[i],problem->model->y[i],
+			problem->data->x[dp],problem->data->y[dp],
+			ch->wscratch);
+    for (j = 0; j < LS_CONTEXT_SIZE; j++) wp[j] += ch->wscratch[j];
+  }
+  LS_POSE_FROM_PARTIAL(wp,sol->pose);
+
+  sol->d[i] = dp;
+  err = LS_DEGENERACY(problem->model,sol->pose,problem->scale);
+  if (err <= best) err += LS_NAME(fitting_error)(problem,sol,best - err);
+  //as in evaluate_move, the refined pose is kept only if it does better,
+  //here in double
+  if (problem->irls && problem->cost)
+    err = LS_NAME(irls_pose)(problem,sol,ch,err,1);
+  sol->d[i] = orig_dp;
+  return err;
+}
+
+//Factored pose solution, for transformation classes that keep one (see
+//projective.c). Tfactor gets the factor of the current match with model
+//point i unpaired. Returns 0 if that could not be formed, in which case
+//moves on i fall back to solving the full context.
+int LS_NAME(drop_pair_factor)(PntMatchProblem problem, context_handle* ch,
+			      int i, int dp)
+{
+  memcpy(ch->tfactor,ch->factor,sizeof(double) * LS_FACTOR_SIZE);
+  if (dp == -1) return 1;
+  return LS_FACTOR_PAIR(ch->tfactor,problem->model->x[i],
+			      problem->model->y[i],problem->data->x[dp],
+			      problem->data->y[dp],-1.0);
+}
+
+//Pose of the current match with model point i paired to data point dp,
+//or left unpaired if dp is -1. The partial context must already reflect
+//the move. Tf says whether tfactor is good.
+void LS_NAME(move_pose)(PntMatchProblem problem, context_handle* ch, int tf,
+	       int i, int dp, Pose pose)
+{
+  if (tf) {
+    if (dp == -1) {
+      LS_POSE_FROM_FACTOR(ch->tfactor,ch->partial,pose);
+      return;
+    }
+    memcpy(ch->cfactor,ch->tfactor,sizeof(double) * LS_FACTOR_SIZE);
+    if (LS_FACTOR_PAIR(ch->cfactor,problem->model->x[i],
+			     problem->model->y[i],problem->data->x[dp],
+			     problem->data->y[dp],1.0)) {
+      LS_POSE_FROM_FACTOR(ch->cfactor,ch->partial,pose);
+      return;
+    }
+  }
+  LS_POSE_FROM_PARTIAL(ch->partial,pose);
+}
+
+//Try pairing model point i with each of the n data points in cand, in
+//order, keeping the best move in bestvalue, best_dp and found. The
+//partial context must have point i's current pair removed. Classes with
+//batched kernels score PM_BATCH candidates per call; any lane the batch
+//can't solve is done the long way, so results don't depend on the path.
+void LS_NAME(try_candidates)(PntMatchProblem problem, Match sol,
+			     context_handle* ch, int i, int tf, int* cand,
+			     int n, double* bestvalue, int* best_dp,
+			     int* found)
+{
+  double u[PM_BATCH], v[PM_BATCH];
+  double* partial = ch->partial;
+  double* factor;
+  double curvalue;
+  int j,k,b,nb,ok;
+
+  if (!LS_BATCHED) {
+    for (k = 0; k < n; k++) {
+      sol->d[i] = cand[k];
+      //get context for pair, add it in
+      LS_CONTEXT_FOR_PAIR(problem->model->x[i],problem->model->y[i],
+				problem->data->x[cand[k]],
+				problem->data->y[cand[k]],ch->scratch);
+      for (j = 0; j < LS_CONTEXT_SIZE; j++)
+	partial[j] += ch->scratch[j];
+      LS_NAME(move_pose)(problem,ch,tf,i,cand[k],sol->pose);
+      curvalue = LS_NAME(evaluate_move)(problem,sol,*bestvalue,ch,i);
+      if (curvalue < *bestvalue) {
+	*best_dp = cand[k];
+	*bestvalue = curvalue;
+	*found = i;
+      }
+      //reset the context for the next pair
+      for (j = 0; j < LS_CONTEXT_SIZE; j++)
+	partial[j] -= ch->scratch[j];
+    }
+    return;
+  }
+
+  factor = tf ? ch->tfactor : NULL;
+  for (k = 0; k < n; k += PM_BATCH) {
+    nb = n - k < PM_BATCH ? n - k : PM_BATCH;
+    //a short last batch is padded with copies of its last candidate
+    for (b = 0; b < PM_BATCH; b++) {
+      j = cand[k + (b < nb ? b : nb - 1)];
+      u[b] = problem->data->x[j];
+      v[b] = problem->data->y[j];
+    }
+    LS_CONTEXT_BATCH(problem->model->x[i],
+				     problem->model->y[i],u,v,ch->bctx);
+    ok = LS_POSE_BATCH(factor,partial,ch->bctx,
+					  ch->bpose);
+    for (b = 0; b < nb; b++) {
+      sol->d[i] = cand[k+b];
+      if (ok & (1 << b))
+	memcpy(sol->pose,ch->bpose + b * LS_POSE_DIM,
+	       sizeof(double) * LS_POSE_DIM);
+      else {
+	for (j = 0; j < LS_CONTEXT_SIZE; j++)
+	  partial[j] += ch->bctx[j*PM_BATCH+b];
+	LS_POSE_FROM_PARTIAL(partial,sol->pose);
+	for (j = 0; j < LS_CONTEXT_SIZE; j++)
+	  partial[j] -= ch->bctx[j*PM_BATCH+b];
+      }
+      curvalue = LS_NAME(evaluate_move)(problem,sol,*bestvalue,ch,i);
+      if (curvalue < *bestvalue) {
+	*best_dp = cand[k+b];
+	*bestvalue = curvalue;
+	*found = i;
+      }
+    }
+  }
+}
+
+/*
+ * Take one step of local search, in a steepest descent manner. 
+ * Neighborhood is all matches that differ from the initial match
+ * one additional pair, one removed pairing, or one model point paired to a 
+ * different data point.
+ *
+ * problem : The problem descriptor.
+ * sol ; The initial match from which to search. Should be in the "expanded"
+ *       format. Condesnsed matches do not work. As part of this, pose
+ *       pose should be allocated.
+ * prev : The index of the pairing changed in the previous step, or -1 if none.
+ * context : The block containing the current pre-computed context for step
+ *           step by step search.  Part of the problem/process_list magic.
+ * pairs : 
+ *
+ * return : -1 means no improvement found.
+ *           Otherwise returns the index of the improved pair 
+ *          (for use in prev in the next round).
+ */
+
+int LS_NAME(local_search_step)(PntMatchProblem problem, Match sol, int prev,
+			       context_handle* ch)
+{
+  double bestvalue, curvalue, prevvalue;
+  int data_size,i,j,n;
+  int usef,tf;
+  int orig_dp;
+  int best_dp = -1;
+  int found = -1;
+  
+  //min defreferncing vars
+  double* modelx;
+  double* modely;
+  double* datax;
+  double* datay;
+  double* partial;
+  double* save;
+  double* scratch;
+  int* sold;
+  BitSet paired;
+  int* near;
+  int pairs;
+  
+  modelx = problem->model->x;
+  modely = problem->model->y;
+  datax = problem->data->x;
+  datay = problem->data->y;
+  sold = sol->d;
+  data_size = problem->data->size;
+  
+  partial = ch->partial;
+  save = ch->save;
+  scratch = ch->scratch;
+  paired = ch->paired;
+  near = ch->near;
+  pairs = ch->pairs;
+  
+  bestvalue = prevvalue = sol->error;
+  
+  //save the original context
+  for (i = 0; i < LS_CONTEXT_SIZE; i++)
+    save[i] = partial[i];
+  LS_NAME(cache_residuals)(problem,sol,ch);
+  usef = LS_FACTOR_SIZE &&
+    LS_FACTOR_FROM_PARTIAL(partial,ch->factor);
+  if (sol->pose == NULL)
+    sol->pose = (Pose) malloc(sizeof(double) * LS_POSE_DIM);
+  
+  //for each possible pair in the solution
+  for (i = 0; i < sol->size; i++) {
+    if (i == prev) continue;
+    orig_dp = sold[i];
+    
+    //Get the context for this pairing, remove it from the original
+    if (orig_dp > -1) {
+      LS_CONTEXT_FOR_PAIR(modelx[i],modely[i],
+				datax[orig_dp],datay[orig_dp],scratch);
+      for (j = 0; j < LS_CONTEXT_SIZE; j++)
+	partial[j] -= scratch[j];
+    }
+    tf = usef && LS_NAME(drop_pair_factor)(problem,ch,i,orig_dp);
+    
+    //Next, check see if we are removing a pair as the first step
+    if (orig_dp != -1 && (pairs-1) >= problem->min_pairs) {
+      sold[i] = -1;
+      LS_NAME(move_pose)(problem,ch,tf,i,-1,sol->pose);
+      curvalue=LS_NAME(evaluate_move)(problem,sol,bestvalue,ch,i);
+      if (curvalue < bestvalue) {
+	best_dp = -1;
+	bestvalue = curvalue;
+	found = i;
+      }
+    }
+    
+      //for each possible different match
+      n = 0;
+      for (j = 0; j < data_size; j++)
+	if (!BIT_TEST(paired,j)) near[n++] = j;
+      LS_NAME(try_candidates)(problem,sol,ch,i,tf,near,n,&bestvalue,
+			      &best_dp,&found);
+
+      sold[i] = orig_dp;
+      for (j = 0; j < LS_CONTEXT_SIZE; j++)
+	partial[j] = save[j];
+
+    } //end of per pair loop
+  
+    if (found != -1 && problem->mixed) {
+      bestvalue = LS_NAME(confirm_move)(problem,sol,ch,found,best_dp,
+					prevvalue);
+      if (!(bestvalue < prevvalue)) {
+	bestvalue = prevvalue;
+	found = -1;
+      }
+    }
+    sol->error = bestvalue;
+    if (found != -1) { //if we found an improvement
+      //do we need to remove a context?
+      if (best_dp == -1) { //drop because whole pair going away
+	BIT_CLEAR(paired,sold[found]);
+	LS_CONTEXT_FOR_PAIR(modelx[found], modely[found],
+				  datax[sold[found]], datay[sold[found]],
+				  scratch);
+	for(j = 0; j < LS_CONTEXT_SIZE; j++)
+	  partial[j] -= scratch[j];
+      }
+      //we need to add in a pair since best_dp != -1
+      else {
+	if (sold[found] != -1) {
+	  LS_CONTEXT_FOR_PAIR(modelx[found], modely[found],
+				    datax[sold[found]], datay[sold[found]],
+				    scratch);
+	  for(j = 0; j < LS_CONTEXT_SIZE; j++)
+	    partial[j] -= scratch[j];
+	  BIT_CLEAR(paired,sold[found]);
+	}
+
+	BIT_SET(paired,best_dp);
+	LS_CONTEXT_FOR_PAIR(modelx[found], modely[found],
+				  datax[best_dp], datay[best_dp], scratch);
+	for(j = 0; j < LS_CONTEXT_SIZE; j++)
+	  partial[j] += scratch[j];
+      }
+      
+      sold[found] = best_dp;
+      return found;
+    }
+    else return -1;
+}
+
+
+int LS_NAME(local_search_quick_step)(PntMatchProblem problem, Match sol,
+				     int prev, context_handle* ch)
+{
+    double bestvalue, curvalue, prevvalue;
+    double tx,ty;
+    double maxdist;
+    int i,j,k,nnear;
+    int usef,tf;
+    int orig_dp;
+    int best_dp = -1;
+    int found = -1;
+  
+    //min defreferncing vars
+    double* modelx;
+    double* modely;
+    double* datax;
+    double* datay;
+    double* partial;
+    double* save;
+    double* scratch;
+    int* sold;
+    BitSet paired;
+    int* near;
+    
+    modelx = problem->model->x;
+    modely = problem->model->y;
+    datax = problem->data->x;
+    datay = problem->data->y;
+    sold = sol->d;
+    maxdist = problem->sigma * 2.0;
+    
+    partial = ch->partial;
+    save = ch->save;
+    scratch = ch->scratch;
+    paired = ch->paired;
+    near = ch->near;
+    
+    bestvalue = prevvalue = sol->error;
+    
+    //save the original context
+    for (i = 0; i < LS_CONTEXT_SIZE; i++)
+      save[i] = partial[i];
+    //also leaves the pose of the current match in extra_pose
+    LS_NAME(cache_residuals)(problem,sol,ch);
+    usef = LS_FACTOR_SIZE &&
+      LS_FACTOR_FROM_PARTIAL(partial,ch->factor);
+    if (sol->pose == NULL)
+      sol->pose = (Pose) malloc(sizeof(double) * LS_POSE_DIM);
+    
+    //for each possible pair in the solution
+    for (i = 0; i < sol->size; i++) {		
+      if (i == prev) continue;
+      orig_dp = sold[i];
+      
+      tx = modelx[i];
+      ty = modely[i];
+      LS_TRANSFORM(&tx,&ty,ch->extra_pose);
+      
+      //Get the context for this pairing, remove it from the original
+      if (orig_dp > -1) {
+	LS_CONTEXT_FOR_PAIR(modelx[i],modely[i],
+				  datax[orig_dp],datay[orig_dp],scratch);
+	for (j = 0; j < LS_CONTEXT_SIZE; j++)
+	  partial[j] -= scratch[j];
+      }
+      tf = usef && LS_NAME(drop_pair_factor)(problem,ch,i,orig_dp);
+      
+      //Next, check to see if we are removing a pair as the first step
+      if (orig_dp != -1) { //removed min pairs check cause qstep is immune
+	sold[i] = -1;
+	LS_NAME(move_pose)(problem,ch,tf,i,-1,sol->pose);
+	curvalue=LS_NAME(evaluate_move)(problem,sol,bestvalue,ch,i);
+	if (curvalue < bestvalue) {
+	  best_dp = -1;
+	  bestvalue = curvalue;
+	  found = i;
+	}
+      }
+      
+      //for each possible different match. Only data points within
+      //sqrt(2) sigma of the transformed model point are worth a look
+      //(maxdist is a squared distance, sigma being stored squared), and
+      //the grid hands us just those, in the same order a full scan would.
+      nnear = pointgrid_within(problem->data_grid,tx,ty,maxdist,near);
+      for (j = k = 0; k < nnear; k++)
+	if (!BIT_TEST(paired,near[k])) near[j++] = near[k];
+      LS_NAME(try_candidates)(problem,sol,ch,i,tf,near,j,&bestvalue,
+			      &best_dp,&found);
+      
+      sold[i] = orig_dp;
+      for (j = 0; j < LS_CONTEXT_SIZE; j++)
+	partial[j] = save[j];
+      
+    } //end of per pair loop
+    
+    if (found != -1 && problem->mixed) {
+      bestvalue = LS_NAME(confirm_move)(problem,sol,ch,found,best_dp,
+					prevvalue);
+      if (!(bestvalue < prevvalue)) {
+	bestvalue = prevvalue;
+	found = -1;
+      }
+    }
+    sol->error = bestvalue;
+    if (found != -1) { //if we found an improvement
+      //do we need to remove a context?
+      if (best_dp == -1) { //drop because whole pair going away
+	BIT_CLEAR(paired,sold[found]);
+	LS_CONTEXT_FOR_PAIR(modelx[found], modely[found],
+				  datax[sold[found]], datay[sold[found]],
+				  scratch);
+	for(j = 0; j < LS_CONTEXT_SIZE; j++)
+	  partial[j] -= scratch[j];
+      }
+      //we need to add in a pair since best_dp != -1
+      else {
+	if (sold[found] != -1) {
+	  LS_CONTEXT_FOR_PAIR(modelx[found], modely[found],
+				    datax[sold[found]], datay[sold[found]],
+				    scratch);
+	  for(j = 0; j < LS_CONTEXT_SIZE; j++)
+	    partial[j] -= scratch[j];
+	  BIT_CLEAR(paired,sold[found]);
+	}
+	
+	BIT_SET(paired,best_dp);
+	LS_CONTEXT_FOR_PAIR(modelx[found], modely[found],
+				  datax[best_dp], datay[best_dp], scratch);
+	for(j = 0; j < LS_CONTEXT_SIZE; j++)
+	  partial[j] += scratch[j];
+      }
+      
+      sold[found] = best_dp;
+      return found;
+    }
+    else return -1;
+}
+
+//context is a per thread scratch space. Find it as :
+//for each thread of execution we need :
+//2) one "context" to hold the current intermediate pose calculations
+//3) one context to hold the intermediate calculations on the last step
+//actually taken, this is the position we revert to when trying a
+//different pair.
+//4) one context to hold the intermediate calculations for just this pair.
+//The context_for_pair routine places results here, and pose
+//calcuation combines 4 & 5 to get 3.
+//5) an array of size data points, which tells us quickly if a data point
+//is available for matching.
+
+
+int LS_NAME(local_search)(PntMatchProblem problem, Match sol,
+			  context_handle* ch)
+{
+  int pstep = -1;
+  int steps = 0;
+  int threshhold;
+  int open_pairs;
+  
+  threshhold = problem->min_pairs * 2;
+  open_pairs = problem->model->size < problem->data->size ?
+    problem->model->size : problem->data->size;
+  
+  if (sol->size != problem->model->size)
+    expand_match(sol,problem->model->size);
+  
+  LS_NAME(initial_context)(problem,sol,ch);
+  
+  //keep stepping as long as we can
+  pstep = LS_NAME(local_search_step)(problem,sol,pstep,ch);
+  while (pstep != -1) {
+    if (sol->d[pstep] != -1) ch->pairs++;
+    else ch->pairs--; 
+    steps++;
+    if (search_cancelled(problem)) break;
+    //With prune set, a trial that has a solid pose (enough pairs for
+    //quick steps) and is still far behind the best any trial has done
+    //is given up on. Each pair it could still add takes at most one off
+    //its error, so those are allowed for. This is still a heuristic, a
+    //better pose can lower the residuals too.
+    if (problem->prune > 0.0 && ch->pairs >= threshhold) {
+      note_best_error(problem,sol->error);
+      if (sol->error - (double) (open_pairs - ch->pairs) >
+	  problem->best_error + problem->prune) break;
+    }
+    if (ch->pairs >= threshhold)
+      pstep = LS_NAME(local_search_quick_step)(problem,sol,pstep,ch); 
+    else
+      pstep = LS_NAME(local_search_step)(problem,sol,pstep,ch);
+  }
+  return steps;
+}
+
+//The entry points of this copy, see register_transform_class.
+const SearchEngineData LS_NAME(search_engine) = {
+  LS_NAME(initial_context),
+  LS_NAME(fitting_error),
+  LS_NAME(cache_residuals),
+  LS_NAME(evaluate_move),
+  LS_NAME(irls_reweight),
+  LS_NAME(local_search_step),
+  LS_NAME(local_search)
+};
+
+#undef LS_NAME
+#undef LS_CONTEXT_SIZE
+#undef LS_POSE_DIM
+#undef LS_FACTOR_SIZE
+#undef LS_BATCHED
+#undef LS_TRANSFORM_POINTS
+#undef LS_TRANSFORM_POINTS_FLOAT
+#undef LS_TRANSFORM
+#undef LS_CONTEXT_FOR_PAIR
+#undef LS_POSE_FROM_PARTIAL
+#undef LS_DEGENERACY
+#undef LS_POSE_SHIFT
+#undef LS_FACTOR_FROM_PARTIAL
+#undef LS_FACTOR_PAIR
+#undef LS_POSE_FROM_FACTOR
+#undef LS_CONTEXT_BATCH
+#undef LS_POSE_BATCH
@@ -5,6 +5,8 @@ char* instructions[] = {
   "ransac <problem file> [trials]",
   "iransac <problem file> [trials]",
   "",
+  "Any of these also take --deadline-ms <milliseconds>.",
+  "",
   "The pntmatcher program finds the mapping between two sets of two",
   "dimensional points. It needs the name of a problem descriptor file as",
   "its first argument. The optional second argument is the number of",
@@ -24,6 +26,25 @@ char* instructions[] = {
   "Denton/Beveridge algorithm is likely to be successful, regaurdless of",
   "the number of trials run.",
   "",
+  "With --deadline-ms the search is given a wall clock budget, counted",
+  "from when the problem has been loaded. Trials are run in priority",
+  "order (for the key feature algorithm, best key features first) until",
+  "the budget runs out. Trials under way are then stopped after their",
+  "current step, the rest are skipped, and the best matches found so",
+  "far are reported. If no trial count is given, 10000 trials are run",
+  "(for the key feature algorithm, the best 10000 key features).",
+  "Setting up the trials, which for the key feature algorithm and",
+  "--guided means scoring key features, gets at most half the budget.",
+  "The best four trials always run to the end, even past the budget,",
+  "so that there is always a match to report.",
+  "",
+  "ransac and iransac also take --guided. Instead of drawing the four",
+  "pairs of each hypothesis at random, they are drawn PROSAC style from",
+  "correspondences ranked by the key features they appear in, starting",
+  "with the best few and widening to the whole ranked list by the last",
+  "trial. Finding the key features takes some time up front, but far",
+  "fewer trials are needed.",
+  "",
   "Point Set file format",
   "",
   "Point sets are specified as plain text files, with one point per line.",
@@ -55,10 +76,12 @@ char* instructions[] = {
   "            each point. In practice, higher values appear to be make",
   "            the search easier. This should be a real.",
   "",
-  "transform   The transformation class relating the two point sets. Should",
-  "            be set to either similarity or projective. The value affine",
-  "            is also understood, but is completely untested for lack of",
-  "            a use case.",
+  "transform   The transformation class relating the two point sets. One",
+  "            of projective (the default), affine, similarity, rigid",
+  "            (rotation and translation only) or translate. The simpler",
+  "            classes solve for their pose in closed form and need fewer",
+  "            pairs, so local search runs several times faster with them",
+  "            than with projective. Use the simplest class that fits.",
   "",
   "instances   The number of model matches that should be reported.",
   "",
@@ -75,4 +98,75 @@ char* instructions[] = {
   "            alter its reporting. This is useful for benchmarking, but",
   "            obviously of no use in finding unknown solutions. This value",
   "            is of course optional.",
+  "",
+  "target      An error at or below which a trial counts as having found",
+  "            an instance of the model, for use with stop. The value",
+  "            solution uses the error of the known solution.",
+  "",
+  "stop        Stop the search once this many trials have reached the",
+  "            target error. Trials not yet started are skipped, and",
+  "            trials under way finish their current step. The default,",
+  "            0, runs every trial.",
+  "",
+  "prune       Give up on a local search trial that has enough pairs to",
+  "            take quick steps but whose error is still more than this",
+  "            far above the best error any trial has reached, even if",
+  "            it paired every point it still could. Off by default.",
+  "            This speeds up long searches, but is a heuristic and can",
+  "            lose solutions.",
+  "",
+  "invariant   Only score key features whose model and data clusters",
+  "            have matching invariant signatures, to within this",
+  "            tolerance. Signatures are logs of lengths or of length",
+  "            ratios, cosines and sines of angles, and for affine the",
+  "            coordinates of a point in the frame of three others, so",
+  "            values of about 0.1 to 0.5 are sensible. Every transform",
+  "            class has one. Off by default. This makes finding key",
+  "            features much cheaper, but with noisy data can throw out",
+  "            good ones.",
+  "",
+  "preemptive  Before fully verifying a RANSAC or iRANSAC hypothesis, check",
+  "            this many model points picked at random, and throw the",
+  "            hypothesis out unless all of them land within sigma of a",
+  "            data point. Off (0) by default. A good hypothesis fails the",
+  "            check when it picks an outlier, so 1 or 2 is usually best,",
+  "            and more trials are needed for the same odds of success.",
+  "            Most useful with --deadline-ms, where the time saved goes",
+  "            to more hypotheses.",
+  "",
+  "confidence  Adaptive RANSAC and iRANSAC. Treat the most pairs any trial",
+  "            has found so far as the number of model inliers, and stop",
+  "            once enough trials have run to have drawn an all correct",
+  "            sample with this probability (for example 0.99). Off (0)",
+  "            by default. The trial count, 10000 by default when this is",
+  "            set, is still an upper limit.",
+  "",
+  "cost        How a pair's error grows with its distance. quadratic (the",
+  "            default) is the squared distance over sigma squared.",
+  "            truncated caps that at robust_scale squared; at the",
+  "            default scale a pair is then never worse than leaving its",
+  "            model point unpaired. huber grows only linearly past",
+  "            robust_scale sigmas, and cauchy only logarithmically, so",
+  "            a few badly placed pairs cost less.",
+  "            Local search cannot skip hopeless moves as quickly with",
+  "            anything other than quadratic, so expect it to be slower.",
+  "",
+  "robust_scale Where truncated and huber part from quadratic, and how",
+  "            far cauchy stays close to it, in units of sigma. 1 by",
+  "            default.",
+  "",
+  "irls        With a cost other than quadratic, refine the pose of any",
+  "            move that would beat the best so far by this many rounds",
+  "            of iteratively reweighted least squares, so that pairs the",
+  "            cost discounts also pull on the pose less. The refined",
+  "            pose is kept only if it lowers the error. Off (0) by",
+  "            default; 1 to 3 rounds is plenty.",
+  "",
+  "precision   double (the default) or mixed. With mixed, local search",
+  "            scores the moves it tries in single precision, which is",
+  "            faster, and scores only the move it takes in double, from",
+  "            a pose solved from scratch. A move that turns out no",
+  "            better in double ends the trial. Near ties between moves",
+  "            can go the other way, so individual trials may take a",
+  "            different path than in double. RANSAC is unaffected.",
   NULL};
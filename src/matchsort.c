@@ -0,0 +1,198 @@
+/**
+ * @file matchsort.c
+ * @author Jason Denton
+ * @version 0.95
+ * @date May, 2009
+ *
+ * Copyright Jason Denton, 2009. This source code is made
+ * available under the terms of the new BSD license. See the file
+ * license.txt for the applicable terms.
+ **/
+
+/* Sorting and top-k selection on lists of matches. Callers of qsort_2t
+   on match lists only ever look at the best few entries: the number of
+   key features they want, or the first few distinct results. These
+   routines work on Match directly, with a typed comparison, and only
+   put the part of the list that will be looked at in order. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pntmatch.h"
+#include "jadmulti.h"
+#include "jadutil.h"
+#include "jadmath.h"
+
+//below this a list is insertion sorted, and is not worth splitting
+//across threads below the second
+#define MS_SMALL 16
+#define MS_PARALLEL 4096
+
+void insertion_sort_matches(Match* list, unsigned long n, MatchOrder order)
+{
+  unsigned long i,j;
+  Match tmp;
+
+  for (i = 1; i < n; i++) {
+    tmp = list[i];
+    for (j = i; j > 0 && order(list[j-1],tmp) > 0; j--)
+      list[j] = list[j-1];
+    list[j] = tmp;
+  }
+}
+
+/*
+ * Stable merge sort of a list of matches.
+ */
+void sort_matches(Match* list, unsigned long n, MatchOrder order)
+{
+  Match* buffer;
+  Match* from;
+  Match* to;
+  Match* tmp;
+  unsigned long w,lo,mid,hi,i,j,k;
+
+  for (lo = 0; lo < n; lo += MS_SMALL)
+    insertion_sort_matches(list+lo,min(MS_SMALL,n-lo),order);
+  if (n <= MS_SMALL) return;
+
+  buffer = malloc_array(Match,n);
+  from = list;
+  to = buffer;
+  for (w = MS_SMALL; w < n; w *= 2) {
+    for (lo = 0; lo < n; lo += 2 * w) {
+      mid = min(lo + w,n);
+      hi = min(lo + 2 * w,n);
+      i = lo; j = mid; k = lo;
+      //take from the left run on ties, which keeps the sort stable
+      while (i < mid && j < hi)
+	to[k++] = order(from[j],from[i]) < 0 ? from[j++] : from[i++];
+      while (i < mid) to[k++] = from[i++];
+      while (j < hi) to[k++] = from[j++];
+    }
+    tmp = from; from = to; to = tmp;
+  }
+  if (from != list) memcpy(list,from,sizeof(Match) * n);
+  free(buffer);
+}
+
+/*
+ * Rearrange list so that its first k entries are the k best, in no
+ * particular order. Quickselect, with a median of three pivot.
+ */
+void select_matches(Match* list, unsigned long n, unsigned long k,
+		    MatchOrder order)
+{
+  long lo,hi,i,j,mid;
+  Match pivot,tmp;
+
+  if (k == 0 || k >= n) return;
+  lo = 0;
+  hi = n - 1;
+  while (hi - lo >= MS_SMALL) {
+    //order list[lo], list[mid], list[hi] and split on the middle one
+    mid = lo + (hi - lo) / 2;
+    if (order(list[mid],list[lo]) < 0)
+      { tmp = list[mid]; list[mid] = list[lo]; list[lo] = tmp; }
+    if (order(list[hi],list[mid]) < 0) {
+      tmp = list[hi]; list[hi] = list[mid]; list[mid] = tmp;
+      if (order(list[mid],list[lo]) < 0)
+	{ tmp = list[mid]; list[mid] = list[lo]; list[lo] = tmp; }
+    }
+    pivot = list[mid];
+
+    //Hoare partition, leaves [lo,j] no worse than the pivot and
+    //[j+1,hi] no better
+    i = lo - 1;
+    j = hi + 1;
+    for (;;) {
+      do i++; while (order(list[i],pivot) < 0);
+      do j--; while (order(pivot,list[j]) < 0);
+      if (i >= j) break;
+      tmp = list[i]; list[i] = list[j]; list[j] = tmp;
+    }
+    if ((long) k - 1 <= j) hi = j;
+    else lo = j + 1;
+  }
+  insertion_sort_matches(list+lo,hi-lo+1,order);
+}
+
+typedef struct {
+  Match* base;
+  unsigned long n;
+  unsigned long k;
+  MatchOrder order;
+} ms_chunk;
+
+void best_matches_thread_func(void* p, int id)
+{
+  ms_chunk* c = (ms_chunk*) p + id;
+
+  select_matches(c->base,c->n,c->k,c->order);
+  sort_matches(c->base,c->k,c->order);
+}
+
+/**
+ * @brief Put the k best matches of a list, in order, at its front.
+ *
+ * The rest of the list is left after them in no particular order, so
+ * the list is still a permutation of what was passed in. Asking for all
+ * of the list sorts it. Long lists are split among the threads of the
+ * process_list pool, each of which finds and sorts the best k of its
+ * part, and the parts are then merged. Matches that compare equal may
+ * come out in any order.
+ *
+ * @param list The list of matches.
+ * @param n The number of matches on the list.
+ * @param k The number wanted in order.
+ * @param order The ranking, as for qsort but on the matches themselves.
+ **/
+void best_matches(Match* list, unsigned long n, unsigned long k,
+		  MatchOrder order)
+{
+  ms_chunk* chunk;
+  Match* buffer;
+  unsigned long* taken;
+  unsigned long i,pos;
+  int np,c,best;
+
+  if (k > n) k = n;
+  np = pool_threads();
+  if (np > 1 && n >= MS_PARALLEL) np = min(np,n / MS_SMALL);
+  else np = 1;
+
+  if (np == 1) {
+    select_matches(list,n,k,order);
+    sort_matches(list,k,order);
+    return;
+  }
+
+  chunk = malloc_array(ms_chunk,np);
+  taken = malloc_array(unsigned long,np);
+  for (c = 0; c < np; c++) {
+    chunk[c].base = list + n / np * c;
+    chunk[c].n = c < np - 1 ? n / np : n - n / np * c;
+    chunk[c].k = min(k,chunk[c].n);
+    chunk[c].order = order;
+    taken[c] = 0;
+  }
+  run_on_pool(best_matches_thread_func,chunk,np);
+
+  //merge the sorted heads of the chunks, then the leftovers in any order
+  buffer = malloc_array(Match,n);
+  for (pos = 0; pos < k; pos++) {
+    best = -1;
+    for (c = 0; c < np; c++) {
+      if (taken[c] == chunk[c].k) continue;
+      if (best == -1 || order(chunk[c].base[taken[c]],
+			      chunk[best].base[taken[best]]) < 0) best = c;
+    }
+    buffer[pos] = chunk[best].base[taken[best]++];
+  }
+  for (c = 0; c < np; c++)
+    for (i = taken[c]; i < chunk[c].n; i++) buffer[pos++] = chunk[c].base[i];
+  memcpy(list,buffer,sizeof(Match) * n);
+
+  free(buffer);
+  free(taken);
+  free(chunk);
+}
@@ -21,10 +21,13 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
 #include "pmproblem.h"
 #include "transclass.h"
 #include "jadutil.h"
 #include "jaddict.h"
+#include "jadmulti.h"
 
 void register_transform_class(PntMatchProblem problem)
 {
@@ -37,6 +40,17 @@ void register_transform_class(PntMatchProblem problem)
     problem->degeneracy = degeneracy_projective;
     problem->pose_from_partial = pose_from_partial_projective;
     problem->context_for_pair = context_for_pair_projective;
+    problem->pose_shift = pose_shift_projective;
+    problem->factor_size = 72;
+    problem->factor_from_partial = factor_from_partial_projective;
+    problem->factor_pair = factor_pair_projective;
+    problem->pose_from_factor = pose_from_factor_projective;
+    problem->context_for_pairs_batch = context_for_pairs_batch_projective;
+    problem->pose_from_partial_batch = pose_from_partial_batch_projective;
+    problem->cluster_invariant = cluster_invariant_projective;
+    problem->transform_batch = transform_batch_projective;
+    problem->transform_batch_float = transform_batch_float_projective;
+    problem->engine = &search_engine_projective;
     problem->context_size = 23;
     problem->context_extra = 72;
     problem->pose_dim = 8;
@@ -48,16 +62,101 @@ void register_transform_class(PntMatchProblem problem)
     problem->degeneracy = degeneracy_similarity;
     problem->context_for_pair = context_for_pair_similarity;
     problem->pose_from_partial = pose_from_partial_similarity;
+    problem->pose_shift = pose_shift_similarity;
+    problem->factor_size = 0; //closed form is already cheap
+    problem->factor_from_partial = NULL;
+    problem->factor_pair = NULL;
+    problem->pose_from_factor = NULL;
+    problem->context_for_pairs_batch = context_for_pairs_batch_similarity;
+    problem->pose_from_partial_batch = pose_from_partial_batch_similarity;
+    problem->cluster_invariant = cluster_invariant_similarity;
+    problem->transform_batch = transform_batch_similarity;
+    problem->transform_batch_float = transform_batch_float_similarity;
+    problem->engine = &search_engine_similarity;
     problem->pose_dim = 4;
     problem->min_pairs = 2;
     problem->context_size = 10;
     problem->context_extra = 0;
     break;
+  case AFFINE :
+    problem->transform = transform_affine;
+    problem->degeneracy = degeneracy_affine;
+    problem->context_for_pair = context_for_pair_affine;
+    problem->pose_from_partial = pose_from_partial_affine;
+    problem->pose_shift = pose_shift_affine;
+    problem->factor_size = 0; //closed form is already cheap
+    problem->factor_from_partial = NULL;
+    problem->factor_pair = NULL;
+    problem->pose_from_factor = NULL;
+    problem->context_for_pairs_batch = context_for_pairs_batch_affine;
+    problem->pose_from_partial_batch = pose_from_partial_batch_affine;
+    problem->cluster_invariant = cluster_invariant_affine;
+    problem->transform_batch = transform_batch_affine;
+    problem->transform_batch_float = transform_batch_float_affine;
+    problem->engine = &search_engine_affine;
+    problem->pose_dim = 6;
+    problem->min_pairs = 3;
+    problem->context_size = 12;
+    problem->context_extra = 0;
+    break;
+  case RIGID : //a similarity with the scale held at one
+    problem->transform = transform_similarity;
+    problem->degeneracy = degeneracy_rigid;
+    problem->context_for_pair = context_for_pair_similarity;
+    problem->pose_from_partial = pose_from_partial_rigid;
+    problem->pose_shift = pose_shift_similarity;
+    problem->factor_size = 0;
+    problem->factor_from_partial = NULL;
+    problem->factor_pair = NULL;
+    problem->pose_from_factor = NULL;
+    problem->context_for_pairs_batch = context_for_pairs_batch_similarity;
+    problem->pose_from_partial_batch = pose_from_partial_batch_rigid;
+    problem->cluster_invariant = cluster_invariant_rigid;
+    problem->transform_batch = transform_batch_similarity;
+    problem->transform_batch_float = transform_batch_float_similarity;
+    problem->engine = &search_engine_rigid;
+    problem->pose_dim = 4;
+    problem->min_pairs = 2;
+    problem->context_size = 10;
+    problem->context_extra = 0;
+    break;
+  case TRANSLATION :
+    problem->transform = transform_translation;
+    problem->degeneracy = degeneracy_translation;
+    problem->context_for_pair = context_for_pair_translation;
+    problem->pose_from_partial = pose_from_partial_translation;
+    problem->pose_shift = pose_shift_translation;
+    problem->factor_size = 0;
+    problem->factor_from_partial = NULL;
+    problem->factor_pair = NULL;
+    problem->pose_from_factor = NULL;
+    problem->context_for_pairs_batch = context_for_pairs_batch_translation;
+    problem->pose_from_partial_batch = pose_from_partial_batch_translation;
+    problem->cluster_invariant = cluster_invariant_translation;
+    problem->transform_batch = transform_batch_translation;
+    problem->transform_batch_float = transform_batch_float_translation;
+    problem->engine = &search_engine_translation;
+    problem->pose_dim = 2;
+    problem->min_pairs = 1;
+    problem->context_size = 3;
+    problem->context_extra = 0;
+    break;
 
   default :
     problem->transform = NULL;
     problem->degeneracy = NULL;
     problem->degeneracy = NULL;
+    problem->pose_shift = NULL;
+    problem->factor_size = 0;
+    problem->factor_from_partial = NULL;
+    problem->factor_pair = NULL;
+    problem->pose_from_factor = NULL;
+    problem->context_for_pairs_batch = NULL;
+    problem->pose_from_partial_batch = NULL;
+    problem->cluster_invariant = NULL;
+    problem->transform_batch = NULL;
+    problem->transform_batch_float = NULL;
+    problem->engine = &search_engine_generic;
     problem->pose_dim = 0;
   }
 
@@ -82,12 +181,44 @@ void register_transform_class(PntMatchProblem problem)
   }
 }
 
+//Float copies of the model and data coordinates for precision=mixed.
+//Local search then ranks the moves of each step by fitting_error_float,
+//which reads half as much memory and transforms twice as many points
+//per SIMD instruction, and only the move it takes is scored in double
+//(see confirm_move in lsengine.h). Call once, after the point sets are
+//settled.
+void set_precision(PntMatchProblem problem, int mixed)
+{
+  PointSet model = problem->model;
+  PointSet data = problem->data;
+  int i;
+
+  problem->mixed = mixed;
+  problem->model_fx = problem->model_fy = NULL;
+  problem->data_fx = problem->data_fy = NULL;
+  if (!mixed) return;
+
+  problem->model_fx = malloc_array(float,2 * (model->size + data->size));
+  problem->model_fy = problem->model_fx + model->size;
+  problem->data_fx = problem->model_fy + model->size;
+  problem->data_fy = problem->data_fx + data->size;
+  for (i = 0; i < model->size; i++) {
+    problem->model_fx[i] = model->x[i];
+    problem->model_fy[i] = model->y[i];
+  }
+  for (i = 0; i < data->size; i++) {
+    problem->data_fx[i] = data->x[i];
+    problem->data_fy[i] = data->y[i];
+  }
+}
+
 PntMatchProblem load_problem(char* fname)
 {
   PntMatchProblem problem;
   Dictionary prop;
   char* value;
   char tmp[128];
+  int mixed;
 
   prop = read_properties(fname);
   if (prop.size == 0) return NULL;
@@ -102,6 +233,28 @@ PntMatchProblem load_problem(char* fname)
   else if (!strcmp(value,"translate")) problem->transformation = TRANSLATION;
   else { free_dictionary(prop); free(problem); return NULL;}
 
+  value = get_value_by_key(prop,"cost");
+  if (!value) problem->cost = PM_COST_QUADRATIC;
+  else if (!strcmp(value,"quadratic")) problem->cost = PM_COST_QUADRATIC;
+  else if (!strcmp(value,"truncated")) problem->cost = PM_COST_TRUNCATED;
+  else if (!strcmp(value,"huber")) problem->cost = PM_COST_HUBER;
+  else if (!strcmp(value,"cauchy")) problem->cost = PM_COST_CAUCHY;
+  else { free_dictionary(prop); free(problem); return NULL;}
+
+  value = get_value_by_key(prop,"precision");
+  if (!value || !strcmp(value,"double")) mixed = 0;
+  else if (!strcmp(value,"mixed")) mixed = 1;
+  else { free_dictionary(prop); free(problem); return NULL;}
+
+  value = get_value_by_key(prop,"robust_scale");
+  if (!value) problem->robust_scale = 1.0;
+  else problem->robust_scale = atof(value);
+  if (!(problem->robust_scale > 0.0)) problem->robust_scale = 1.0;
+
+  value = get_value_by_key(prop,"irls");
+  if (!value) problem->irls = 0;
+  else problem->irls = atoi(value);
+
   value = get_value_by_key(prop,"data");
   if (!value) { free_dictionary(prop); free(problem); return NULL; }
   problem->data = load_pointset(value);
@@ -141,19 +294,58 @@ PntMatchProblem load_problem(char* fname)
   problem->un_sigma = problem->sigma;
   register_transform_class(problem);
   problem->sigma *= problem->sigma;
+  //quick step local search looks for data points within sqrt(2) sigma
+  problem->data_grid = build_pointgrid(problem->data,
+				       sqrt(2.0 * problem->sigma));
+  set_precision(problem,mixed);
 
   if (problem->solution) evaluate_match(problem,problem->solution,99999999.99);
+
+  //early termination, see note_trial_result
+  value = get_value_by_key(prop,"target");
+  if (!value) problem->target = -1.0;
+  else if (!strcmp(value,"solution"))
+    problem->target = problem->solution ? 
+      problem->solution->error + 1e-6 : -1.0;
+  else problem->target = atof(value);
+
+  value = get_value_by_key(prop,"stop");
+  if (!value) problem->stop_after = 0;
+  else problem->stop_after = atoi(value);
+
+  value = get_value_by_key(prop,"prune");
+  if (!value) problem->prune = 0.0;
+  else problem->prune = atof(value);
+
+  value = get_value_by_key(prop,"invariant");
+  if (!value) problem->invariant = 0.0;
+  else problem->invariant = atof(value);
+
+  value = get_value_by_key(prop,"preemptive");
+  if (!value) problem->preemptive = 0;
+  else problem->preemptive = atoi(value);
+
+  value = get_value_by_key(prop,"confidence");
+  if (!value) problem->confidence = 0.0;
+  else problem->confidence = atof(value);
+
+  problem->deadline = 0.0;
+  reset_search_state(problem);
   free_dictionary(prop);
   return problem;
 }
 
 void free_problem(PntMatchProblem problem)
 {
+  //search contexts kept by process_list for this problem
+  flush_scratch_cache(problem);
   free_pointset(problem->model);
   free_pointset(problem->data);
   if (problem->model != problem->un_model) free_pointset(problem->un_model);
   if (problem->data != problem->un_data) free_pointset(problem->un_data);
   if (problem->solution) free_match(problem->solution);
+  free_pointgrid(problem->data_grid);
+  free(problem->model_fx);
   free(problem->name);
   free(problem);
 }
@@ -204,9 +396,13 @@ void* get_search_context(void* prb)
   problem = (PntMatchProblem) prb;
 
   cs = problem->pose_dim * 2 + problem->context_extra +
-	problem->context_size * 3;
+	problem->context_size * 3 + problem->model->size * 4 + 2 +
+	problem->factor_size * 3 +
+	(problem->context_size + problem->pose_dim) * PM_BATCH +
+	problem->context_size * 2 + problem->context_extra + problem->pose_dim;
   cs *= sizeof(double);
-  cs += sizeof(char) * problem->data->size;
+  cs += sizeof(int) * problem->data->size;
+  cs += sizeof(unsigned int) * BITSET_WORDS(problem->data->size);
   rc = malloc(cs);
 
   handle = (context_handle*) malloc(sizeof(context_handle));
@@ -217,8 +413,28 @@ void* get_search_context(void* prb)
   handle->scratch = handle->pose + problem->pose_dim;
   handle->save = handle->scratch + problem->context_size;
   handle->partial = handle->save + problem->context_size;
-  rc = handle->partial + problem->context_size + problem->context_extra;
-  handle->paired = (char*) rc;
+  handle->resid = handle->partial + problem->context_size +
+    problem->context_extra;
+  handle->rsorted = handle->resid + problem->model->size;
+  handle->rsum = handle->rsorted + problem->model->size;
+  handle->rsum2 = handle->rsum + problem->model->size + 1;
+  handle->cached = 0;
+  handle->factor = handle->rsum2 + problem->model->size + 1;
+  handle->tfactor = handle->factor + problem->factor_size;
+  handle->cfactor = handle->tfactor + problem->factor_size;
+  handle->bctx = handle->cfactor + problem->factor_size;
+  handle->bpose = handle->bctx + problem->context_size * PM_BATCH;
+  handle->wpartial = handle->bpose + problem->pose_dim * PM_BATCH;
+  handle->wscratch = handle->wpartial + problem->context_size +
+    problem->context_extra;
+  handle->wpose = handle->wscratch + problem->context_size;
+  rc = handle->wpose + problem->pose_dim;
+  handle->near = (int*) rc;
+  handle->paired = (BitSet) (handle->near + problem->data->size);
+  //room for a few working matches and their poses
+  handle->arena = new_arena((sizeof(MatchData) +
+			     sizeof(int) * 2 * problem->model->size +
+			     sizeof(double) * problem->pose_dim) * 4);
   return (void*) handle;
 
 }
@@ -226,7 +442,7 @@ void* get_search_context(void* prb)
 PntMatchProblem inverse_problem(PntMatchProblem problem)
 {
   PntMatchProblem ip;
-  short* tmp;
+  int* tmp;
 
   ip = (PntMatchProblem) malloc(sizeof(PntMatchProblemData));
   ip->transformation = problem->transformation;
@@ -247,16 +463,93 @@ PntMatchProblem inverse_problem(PntMatchProblem problem)
   ip->name = strcpy(ip->name,problem->name);
   register_transform_class(ip);
   ip->sigma *= ip->sigma;
+  ip->data_grid = build_pointgrid(ip->data,sqrt(2.0 * ip->sigma));
+  set_precision(ip,problem->mixed);
+  ip->target = problem->target;
+  ip->stop_after = problem->stop_after;
+  ip->prune = problem->prune;
+  ip->invariant = problem->invariant;
+  ip->cost = problem->cost;
+  ip->robust_scale = problem->robust_scale;
+  ip->irls = problem->irls;
+  ip->preemptive = problem->preemptive;
+  ip->confidence = problem->confidence;
+  ip->deadline = problem->deadline;
+  reset_search_state(ip);
 
   if (ip->solution) evaluate_match(ip,ip->solution,99999999.99);
   return ip;
 }
 
+//Forget everything previous searches on this problem found.
+void reset_search_state(PntMatchProblem problem)
+{
+  problem->best_error = HUGE_VAL;
+  problem->found = 0;
+  problem->cancel = 0;
+  problem->best_pairs = 0;
+  problem->trials_done = 0;
+}
+
+//Lower the shared best error to error, if error is better.
+void note_best_error(PntMatchProblem problem, double error)
+{
+  double cur;
+
+  cur = problem->best_error;
+  while (error < cur)
+    if (__atomic_compare_exchange((double*) &problem->best_error,&cur,&error,
+				  0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST))
+      break;
+}
+
+//Called by the search wrappers with the result of each trial. A trial
+//at or below the target error counts as a found instance, and once
+//stop_after instances have been found the search is cancelled.
+void note_trial_result(PntMatchProblem problem, Match match)
+{
+  note_best_error(problem,match->error);
+  if (problem->stop_after > 0 && match->error <= problem->target &&
+      __sync_add_and_fetch(&problem->found,1) >= problem->stop_after)
+    problem->cancel = 1;
+  search_cancelled(problem);
+}
+
+//Seconds on a monotonic wall clock. Unlike clock() this keeps counting
+//while we wait, and doesn't add up the time of every thread.
+double wall_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//Have the search cancel itself ms milliseconds from now.
+void set_search_deadline(PntMatchProblem problem, double ms)
+{
+  problem->deadline = wall_clock() + ms * 0.001;
+}
+
+//True once the search should stop, either because it was cancelled or
+//because the deadline has passed. Long running searches should call
+//this every so often; it is what notices the deadline.
+int search_cancelled(PntMatchProblem problem)
+{
+  if (problem->cancel) return 1;
+  if (problem->deadline > 0.0 && wall_clock() >= problem->deadline) {
+    problem->cancel = 1;
+    return 1;
+  }
+  return 0;
+}
+
 void free_search_context(void* foo, void* ch)
 {
   //parameter foo is bogus, cause listproc routine wants to provide 
   //the problem handle with the scratch space.
   free(((context_handle*)ch)->extra_pose);
+  free_arena(((context_handle*)ch)->arena);
   free(ch);
 }
 
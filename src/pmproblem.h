@@ -17,6 +17,8 @@ transform=projective
 instances=1
 spurious=1
 solution=(1,1) (2,2) (3,3)
+target=solution
+stop=1
 */
 
 //the solution field is optional. if present, the solution must not have a 
@@ -27,12 +29,14 @@ solution=(1,1) (2,2) (3,3)
 
 #include "pntset.h"
 #include "pntmatch.h"
+#include "pntgrid.h"
 
 typedef struct {
   char* name;
   PointSet model, un_model;
   PointSet data, un_data;
   Match solution;
+  PointGrid data_grid;
   double sigma, un_sigma;
   unsigned char transformation;
   double scale;
@@ -48,21 +52,99 @@ typedef struct {
   double (*degeneracy)(PointSet, Pose, double);
   void (*context_for_pair)(double,double,double,double,double*);
   void (*pose_from_partial)(double*,Pose);
+  double (*pose_shift)(PointSet, Pose, Pose);
+  //optional factored pose solution, see projective.c. NULL if the
+  //transformation class has no use for it.
+  int factor_size;
+  int (*factor_from_partial)(double*, double*);
+  int (*factor_pair)(double*, double, double, double, double, double);
+  void (*pose_from_factor)(double*, double*, Pose);
+  //optional batched kernels, scoring PM_BATCH candidate pairs for one
+  //model point at once. NULL if the class only has the scalar versions.
+  void (*context_for_pairs_batch)(double, double, double*, double*, double*);
+  int (*pose_from_partial_batch)(double*, double*, double*, double*);
+  //optional invariant signature of an ordered neighborhood cluster, used
+  //to skip key features whose clusters cannot correspond. NULL if the
+  //class has none.
+  int (*cluster_invariant)(PointSet, int*, int, double*);
+  //optional batch transform of n points, from x,y to tx,ty (which must
+  //not overlap them). NULL if the class only has the scalar transform;
+  //use transform_points rather than calling it directly.
+  void (*transform_batch)(double*, double*, int, Pose, double*, double*);
+  //the same in single precision, for precision=mixed. NULL if the class
+  //has none.
+  void (*transform_batch_float)(float*, float*, int, Pose, float*, float*);
+  //the local search engine built for this class, see lsengine.h
+  const struct SearchEngineData* engine;
+  int cost;                   //PM_COST_*, see robust_cost
+  double robust_scale;        //where the robust cost bends, in sigmas
+  int irls;                   //reweighted pose rounds per move, 0 for none
+  int mixed;                  //rank moves in float, see set_precision
+  float *model_fx, *model_fy; //float copies of the coordinates, if mixed
+  float *data_fx, *data_fy;   //all four in the one block at model_fx
+  double invariant;           //signature tolerance, 0 for no prefilter
+  int preemptive;             //RANSAC T(d,d) test points, 0 for none
+  double confidence;          //adaptive RANSAC stop, 0 for none
+  volatile int best_pairs;    //most pairs any RANSAC trial has found
+  volatile unsigned long trials_done;
+  //search state shared by all worker threads, see note_trial_result
+  volatile double best_error; //best error any trial has reached so far
+  volatile int found;         //trials that ended at or below target
+  volatile int cancel;        //set to stop the search
+  double target;
+  int stop_after;             //cancel after this many found, 0 for never
+  double prune;               //0 for never, see local_search
+  double deadline;            //wall_clock time to stop at, 0 for none
 } PntMatchProblemData;
 
 typedef PntMatchProblemData* PntMatchProblem;
 
 typedef struct {
   int pairs; 
-  char* paired;
+  BitSet paired;
+  int* near;
   double* pose;
   double* save;
   double* scratch;
   double* partial;
   double* extra_pose;
   //  double* extra;
+  //residual cache for incremental evaluation, see cache_residuals
+  int cached;
+  double* resid;
+  double* rsorted;
+  double* rsum;
+  double* rsum2;
+  //factors of the current match, the match less one pair, and the
+  //candidate being tried
+  double* factor;
+  double* tfactor;
+  double* cfactor;
+  //batched contexts (one column per candidate) and poses
+  double* bctx;
+  double* bpose;
+  //reweighted context, pair context and pose for irls_pose
+  double* wpartial;
+  double* wscratch;
+  double* wpose;
+  //per-thread scratch memory for temporary matches and poses. Reset at
+  //the start of each item a worker processes.
+  Arena arena;
 } context_handle;
 
+//One copy of the local search engine, see lsengine.h. The functions of
+//the same names dispatch through the engine of the problem.
+typedef struct SearchEngineData {
+  int (*initial_context)(PntMatchProblem, Match, context_handle*);
+  double (*fitting_error)(PntMatchProblem, Match, double);
+  void (*cache_residuals)(PntMatchProblem, Match, context_handle*);
+  double (*evaluate_move)(PntMatchProblem, Match, double, context_handle*,
+			  int);
+  int (*irls_reweight)(PntMatchProblem, Match, context_handle*, double*);
+  int (*local_search_step)(PntMatchProblem, Match, int, context_handle*);
+  int (*local_search)(PntMatchProblem, Match, context_handle*);
+} SearchEngineData;
+
 #define TRANSLATION 2
 #define RIGID 3
 #define SIMILARITY 4
@@ -71,6 +153,42 @@ typedef struct {
 
 #define FULL_EVAL 2e21
 
+//Costs of a pair, as a function of its residual r in sigmas. None of
+//them is ever above the quadratic, so a bad pair pulls on the match
+//less. Truncated and huber agree with it below robust_scale; cauchy is
+//below it for any r > 0, and close to it only for r well under
+//robust_scale.
+#define PM_COST_QUADRATIC 0 //r^2
+#define PM_COST_TRUNCATED 1 //r^2, capped at robust_scale^2
+#define PM_COST_HUBER 2     //quadratic, then linear past robust_scale
+#define PM_COST_CAUCHY 3    //robust_scale^2 log(1 + r^2/robust_scale^2)
+
+//Number of candidate pairs scored together by the batched kernels. The
+//kernels are written as loops over the batch, which the compiler turns
+//into SIMD when the target has it (see Make_Setup.inc).
+#define PM_BATCH 4
+
+//The batch transform kernels are plain loops over the point arrays, so
+//any build with the vectorizer on (-O3) gets SIMD for its target. Under
+//GCC on x86-64 Linux they are also compiled once per instruction set,
+//and the loader picks the best copy the CPU supports, so a generic build
+//still gets AVX2 or AVX-512. FMA contraction is left off so that all of
+//the copies give the same results.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+  defined(__linux__)
+#define PM_TRANSFORM_KERNEL \
+  __attribute__((target_clones("avx512f","avx2","default"), \
+		 optimize("fp-contract=off")))
+#else
+#define PM_TRANSFORM_KERNEL
+#endif
+
+//Points fitting_error transforms at a time.
+#define PM_FIT_BLOCK 16
+
+//Most values a cluster_invariant signature may have.
+#define PM_MAX_INVARIANT 4
+
 #ifdef __CPLUSPLUS
 extern "C" {
 #endif
@@ -85,6 +203,13 @@ extern "C" {
   void free_search_context(void*, void*);
   int initial_context(PntMatchProblem, Match, context_handle*);
   PntMatchProblem inverse_problem(PntMatchProblem);
+  void set_precision(PntMatchProblem, int);
+  void reset_search_state(PntMatchProblem);
+  void note_best_error(PntMatchProblem, double);
+  void note_trial_result(PntMatchProblem, Match);
+  int search_cancelled(PntMatchProblem);
+  double wall_clock(void);
+  void set_search_deadline(PntMatchProblem, double);
 
   //evalution goes here because it requires a problem struct, it is defined
   //in its own file, along with the generic fitting error routine
@@ -92,8 +217,23 @@ extern "C" {
   //as defined by the problem and stores the results).
   double evaluate_match(PntMatchProblem, Match, double);
   double evaluate_match_with_partial(PntMatchProblem, Match,double, double*);
+  void cache_residuals(PntMatchProblem, Match, context_handle*);
+  double evaluate_move_with_partial(PntMatchProblem, Match, double, double*,
+				    context_handle*, int);
+  double evaluate_move(PntMatchProblem, Match, double, context_handle*, int);
+  int irls_reweight(PntMatchProblem, Match, context_handle*, double*);
+  double fitting_error(PntMatchProblem, Match, double);
+  double robust_cost(PntMatchProblem, double);
+  double robust_weight(PntMatchProblem, double);
+  int compare_residual(const void*, const void*);
+  double residual_bound(context_handle*, double, int);
   PointSet transform_pointset(PointSet,Pose,void (*t)(double*, double*,Pose));
+  void transform_points(PntMatchProblem, double*, double*, int, Pose,
+			double*, double*);
+  void transform_points_float(PntMatchProblem, float*, float*, int, Pose,
+			      float*, float*);
   int model_pose(PntMatchProblem, Match);
+  double* irls_weights(PntMatchProblem, Match);
   void proper_pose(PntMatchProblem, Match);
   void pose_to_hetro(Pose in, double* out, int dim);
   void print_pose(Pose,int);
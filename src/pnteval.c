@@ -10,88 +10,88 @@
  **/
 
 #include <stdlib.h>
+#include <math.h>
 #include "pmproblem.h"
 
-//Given a problem, match, and context object, this routine fills out the
-//context and prepares it for use in determining pose.
-int initial_context(PntMatchProblem problem, Match sol, context_handle* ch)
+//The cost of a pair with squared distance d2 under the problem's
+//robust cost, see PM_COST_*. Like d2 it is in squared pixels (so it is
+//d2 itself for the quadratic cost), and it is never more than d2.
+double robust_cost(PntMatchProblem problem, double d2)
 {
-  int i,j;
+  double r2,c2;
 
-  ch->pairs = 0;
-  //build the initial context
-  for(i = 0; i < problem->context_size; i++)
-    ch->partial[i] = 0.0;
-  for (i = 0; i < problem->data->size; i++)
-    ch->paired[i] = 0;
-  for (i = 0; i < sol->size; i++) {
-    if (sol->d[i] == -1) continue;
-    ch->pairs++;
-    ch->paired[sol->d[i]] = 1;
-    problem->context_for_pair(problem->model->x[sol->m[i]],
-			      problem->model->y[sol->m[i]],
-			      problem->data->x[sol->d[i]],
-			      problem->data->y[sol->d[i]],
-			      ch->scratch);
-    for(j = 0; j < problem->context_size; j++)
-      ch->partial[j] += ch->scratch[j];
+  r2 = d2 / problem->sigma;
+  c2 = problem->robust_scale * problem->robust_scale;
+  switch (problem->cost) {
+  case PM_COST_TRUNCATED :
+    if (r2 > c2) r2 = c2;
+    break;
+  case PM_COST_HUBER :
+    if (r2 > c2) r2 = 2.0 * problem->robust_scale * sqrt(r2) - c2;
+    break;
+  case PM_COST_CAUCHY :
+    r2 = c2 * log(1.0 + r2 / c2);
+    break;
+  }
+  return r2 * problem->sigma;
+}
+
+//The weight iteratively reweighted least squares gives a pair with
+//squared distance d2 under the problem's robust cost: its share of the
+//pull a quadratic cost would give it.
+double robust_weight(PntMatchProblem problem, double d2)
+{
+  double r2,c2;
+
+  r2 = d2 / problem->sigma;
+  c2 = problem->robust_scale * problem->robust_scale;
+  switch (problem->cost) {
+  case PM_COST_TRUNCATED :
+    return r2 > c2 ? 0.0 : 1.0;
+  case PM_COST_HUBER :
+    return r2 > c2 ? problem->robust_scale / sqrt(r2) : 1.0;
+  case PM_COST_CAUCHY :
+    return 1.0 / (1.0 + r2 / c2);
   }
-  return ch->pairs;
+  return 1.0;
 }
 
-/* Evaulte a the fit of a solution, and return the error in the
-   fit. Model should be a transformed version of the model, not the
-   original.  Terminates when error exceeeds current best. */
+//Transform n points from x,y into tx,ty, with the batch kernel of the
+//transformation class if it has one.
+void transform_points(PntMatchProblem problem, double* x, double* y, int n,
+		      Pose pose, double* tx, double* ty)
+{
+  int i;
+
+  if (problem->transform_batch) {
+    problem->transform_batch(x,y,n,pose,tx,ty);
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    tx[i] = x[i];
+    ty[i] = y[i];
+    problem->transform(tx+i,ty+i,pose);
+  }
+}
 
-double fitting_error(PntMatchProblem problem, Match match,
-		     double best)
+//transform_points in single precision, for precision=mixed.
+void transform_points_float(PntMatchProblem problem, float* x, float* y,
+			    int n, Pose pose, float* tx, float* ty)
 {
-  double err = 0.0;
-  int pairings = 0;
-  int mp,dp,i;
-  double t1,t2,tx,ty;
-  double tmp;
-
-  PointSet model;
-  PointSet data;
-
-  //grab and store model/data sets. save repeated offset from problem
-  model = problem->model;
-  data = problem->data;
-
-  for (i = 0; i < match->size; i++) {
-    // grab and store model/data pair
-    dp = match->d[i];
-    if (dp == -1) {
-      best -= 1.0;
-      continue; // skip if model point not paired
-    }
-    
-    mp = match->m[i];
-    
-    //ok, lazy transform
-    //we transform only points in the match
-    //we break apart the trnasform, to try and help optimizers
-    tx = model->x[mp];
-    ty = model->y[mp];
-    problem->transform(&tx,&ty,match->pose);
-    
-    //compute additional fitting error on this point, and to sum
-    t1 = tx - data->x[dp]; t1 *= t1;
-    t2 = ty - data->y[dp]; t2 *= t2;
-    tmp = t1 + t2;
-    err += tmp;
-    best -= (tmp / problem->sigma);
-
-    //bail if we know we've exceed our bounds
-    //we return max penalty to signal that we did not do a full eval
-    
-    if (best < 0.0) return BAD_MATCH_PENALTY;
-    pairings++; //count this pair
+  double u,v;
+  int i;
+
+  if (problem->transform_batch_float) {
+    problem->transform_batch_float(x,y,n,pose,tx,ty);
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    u = x[i];
+    v = y[i];
+    problem->transform(&u,&v,pose);
+    tx[i] = (float) u;
+    ty[i] = (float) v;
   }
-  //don't check # pairings here to ensure valid pose, now done in pose
-  //routines as it should
-  return (err/problem->sigma) + ((double) (model->size - pairings));
 }
 
 //this function returns a copy of a pointset, transformed by the given pose
@@ -181,6 +181,70 @@ double evaluate_match_with_partial(PntMatchProblem problem, Match match,
   return match->error;
 }
 
+//Incremental evaluation. A local search move changes a single pair,
+//so the pose it produces is usually close to the pose of the match we
+//are moving from. cache_residuals records how far each paired model
+//point sits from its data point under that reference pose. If no model
+//point moves more than D between the two poses, no pair can end up
+//closer than its cached residual less D, which bounds the error of a
+//move from below without transforming a single model point.
+
+int compare_residual(const void* a, const void* b)
+{
+  if (*(double*)a < *(double*)b) return -1;
+  if (*(double*)a > *(double*)b) return 1;
+  return 0;
+}
+
+//Lower bound on the pair residuals after a move, given every model
+//point moved at most shift. Idx is the pair being changed; its old
+//residual tells us nothing about the new pair.
+double residual_bound(context_handle* ch, double shift, int idx)
+{
+  int lo,hi,k,n;
+  double sum,slack,t;
+
+  n = ch->cached;
+  lo = 0; hi = n;
+  while (lo < hi) {
+    k = (lo + hi) / 2;
+    if (ch->rsorted[k] > shift) hi = k;
+    else lo = k + 1;
+  }
+
+  //sum of (r - shift)^2 over residuals beyond shift
+  sum = ch->rsum2[lo] - 2.0 * shift * ch->rsum[lo] +
+    (double) (n - lo) * shift * shift;
+  slack = ch->rsum2[lo] + 2.0 * shift * ch->rsum[lo] +
+    (double) (n - lo) * shift * shift;
+  if (ch->resid[idx] > shift) {
+    t = ch->resid[idx] - shift;
+    sum -= t * t;
+    slack += t * t;
+  }
+  //the expansion above cancels badly, so back off by more than any
+  //rounding it could have picked up
+  sum -= slack * 1e-9;
+  return sum > 0.0 ? sum : 0.0;
+}
+
+//Same contract as evaluate_match_with_partial, for a match that differs
+//from the one last given to cache_residuals only in pair idx. Moves
+//that provably cannot beat best are rejected before the full fitting
+//error is computed; the value returned for them is above best, just as
+//it is when fitting_error bails out early.
+double evaluate_move_with_partial(PntMatchProblem problem, Match match,
+				  double best, double* partial,
+				  context_handle* ch, int idx)
+{
+  if (match->pose == NULL)
+    match->pose = (Pose) malloc(sizeof(double) * problem->pose_dim);
+  
+  problem->pose_from_partial(partial,match->pose);
+  return evaluate_move(problem,match,best,ch,idx);
+}
+
+
 void pose_to_hetro(Pose in, double* out, int dim)
 {
   int i;
@@ -213,6 +277,44 @@ void pose_to_hetro(Pose in, double* out, int dim)
  }
 }
 
+//With irls set, the weights proper_pose refits sol with. They are found
+//by irls_reweight, as local search finds them, starting from the least
+//squares pose, and kept only if they give a better fit. sol->error is
+//set to the error of the pose kept, so that the fitness reported goes
+//with the pose reported. NULL if sol has too few pairs for a pose.
+double* irls_weights(PntMatchProblem problem, Match sol)
+{
+  context_handle* ch;
+  double* weight;
+  Pose keep = sol->pose;
+  double e;
+  int i;
+
+  ch = get_search_context(problem);
+  if (initial_context(problem,sol,ch) < problem->min_pairs) {
+    free_search_context(NULL,ch);
+    return NULL;
+  }
+  weight = (double*) malloc(sizeof(double) * sol->size * 2);
+
+  problem->pose_from_partial(ch->partial,ch->pose);
+  sol->pose = ch->pose;
+  sol->error = problem->degeneracy(problem->model,sol->pose,problem->scale);
+  sol->error += fitting_error(problem,sol,HUGE_VAL);
+
+  e = HUGE_VAL;
+  if (irls_reweight(problem,sol,ch,weight)) {
+    sol->pose = ch->wpose;
+    e = problem->degeneracy(problem->model,sol->pose,problem->scale);
+    e += fitting_error(problem,sol,HUGE_VAL);
+  }
+  if (e < sol->error) sol->error = e;
+  else for (i = 0; i < sol->size; i++) weight[i] = 1.0;
+  sol->pose = keep;
+  free_search_context(NULL,ch);
+  return weight;
+}
+
 //the pose from evaluate match is incorrect with respect to the 
 //original data. This corrects for that. Pose returned is always
 //projective, regardless of original. This routine is needed
@@ -222,8 +324,11 @@ void proper_pose(PntMatchProblem problem, Match sol)
 {
   context_handle* ch;
   double* np;
+  double* weight = NULL;
+  double w;
   int i,j;
    
+  if (problem->irls && problem->cost) weight = irls_weights(problem,sol);
   ch = get_search_context(problem);
   if (sol->pose != NULL) free(sol->pose);
   sol->pose = ch->pose;
@@ -233,19 +338,20 @@ void proper_pose(PntMatchProblem problem, Match sol)
 
   for(i = 0; i < problem->context_size; i++)
     ch->partial[i] = 0.0;
-  for (i = 0; i < problem->data->size; i++)
+  for (i = 0; i < BITSET_WORDS(problem->data->size); i++)
     ch->paired[i] = 0;
   for (i = 0; i < sol->size; i++) {
     if (sol->d[i] == -1) continue;
     ch->pairs++;
-    ch->paired[sol->d[i]] = 1;
+    BIT_SET(ch->paired,sol->d[i]);
     problem->context_for_pair(problem->un_model->x[sol->m[i]],
 			      problem->un_model->y[sol->m[i]],
 			      problem->un_data->x[sol->d[i]],
 			      problem->un_data->y[sol->d[i]],
 			      ch->scratch);
+    w = weight ? weight[i] : 1.0;
     for(j = 0; j < problem->context_size; j++)
-      ch->partial[j] += ch->scratch[j];
+      ch->partial[j] += w * ch->scratch[j];
   }
   
   problem->pose_from_partial(ch->partial,sol->pose);
@@ -254,4 +360,5 @@ void proper_pose(PntMatchProblem problem, Match sol)
   pose_to_hetro(sol->pose,np,problem->pose_dim);
   sol->pose = np;
   free_search_context(NULL,ch);
+  free(weight);
 }
@@ -0,0 +1,219 @@
+/**
+ * @file pntgrid.c
+ * @author Jason Denton
+ * @version 0.95
+ * @date May, 2009
+ *
+ * Copyright Jason Denton, 2009. This source code is made
+ * available under the terms of the new BSD license. See the file
+ * license.txt for the applicabe terms.
+ **/
+
+#include <stdlib.h>
+#include <math.h>
+#include "pntgrid.h"
+#include "jadutil.h"
+
+/*
+ * Build a grid over the given point set. Cell is the preferred edge
+ * length of a cell, normally the radius of the queries that will be
+ * made against the grid. If that would produce far more cells than
+ * points the cell is grown, so the grid never needs more than a few
+ * words of memory per point.
+ */
+PointGrid build_pointgrid(PointSet pset, double cell)
+{
+  PointGrid grid;
+  double w,h;
+  int i,c,ncells;
+  int* fill;
+
+  grid = (PointGrid) malloc(sizeof(PointGridData));
+  grid->size = pset->size;
+
+  //bounds are recomputed rather than trusting lx/ux, since those are
+  //not kept up to date by everyone who moves points around
+  grid->lx = grid->ux = pset->size ? pset->x[0] : 0.0;
+  grid->ly = grid->uy = pset->size ? pset->y[0] : 0.0;
+  for (i = 1; i < pset->size; i++) {
+    if (pset->x[i] < grid->lx) grid->lx = pset->x[i];
+    if (pset->x[i] > grid->ux) grid->ux = pset->x[i];
+    if (pset->y[i] < grid->ly) grid->ly = pset->y[i];
+    if (pset->y[i] > grid->uy) grid->uy = pset->y[i];
+  }
+  w = grid->ux - grid->lx;
+  h = grid->uy - grid->ly;
+
+  //no more than ~4 cells per point
+  if (cell <= 0.0) cell = sqrt((w * h + 1e-12) / (pset->size + 1));
+  while ((w / cell + 1.0) * (h / cell + 1.0) > 4.0 * (pset->size + 1))
+    cell *= 2.0;
+
+  grid->cell = cell;
+  grid->inv_cell = 1.0 / cell;
+  grid->cols = (int) (w * grid->inv_cell) + 1;
+  grid->rows = (int) (h * grid->inv_cell) + 1;
+  ncells = grid->cols * grid->rows;
+
+  grid->start = malloc_array(int,ncells+1);
+  grid->index = malloc_array(int,pset->size);
+  grid->x = malloc_array(double,pset->size);
+  grid->y = malloc_array(double,pset->size);
+  fill = malloc_array(int,pset->size);
+
+  //counting sort of the points into their cells. Walking the points
+  //in order keeps indices ascending inside each cell.
+  for (c = 0; c <= ncells; c++) grid->start[c] = 0;
+  for (i = 0; i < pset->size; i++) {
+    c = (int) ((pset->y[i] - grid->ly) * grid->inv_cell) * grid->cols +
+      (int) ((pset->x[i] - grid->lx) * grid->inv_cell);
+    fill[i] = c;
+    grid->start[c+1]++;
+  }
+  for (c = 0; c < ncells; c++) grid->start[c+1] += grid->start[c];
+  for (i = 0; i < pset->size; i++) {
+    c = grid->start[fill[i]]++;
+    grid->index[c] = i;
+    grid->x[c] = pset->x[i];
+    grid->y[c] = pset->y[i];
+  }
+  //the fill pass advanced each start to the next cell's start, shift back
+  for (c = ncells; c > 0; c--) grid->start[c] = grid->start[c-1];
+  grid->start[0] = 0;
+
+  free(fill);
+  return grid;
+}
+
+void free_pointgrid(PointGrid grid)
+{
+  if (!grid) return;
+  free(grid->start);
+  free(grid->index);
+  free(grid->x);
+  free(grid->y);
+  free(grid);
+}
+
+/*
+ * Find every point whose squared distance from (x,y) is no more than
+ * r2. Indices are written to out (which must have room for the whole
+ * set) in ascending order, so callers walking them see the points in
+ * the same order as a scan over the original point set would.
+ *
+ * return : The number of points found.
+ */
+int pointgrid_within(PointGrid grid, double x, double y, double r2,
+		     int* out)
+{
+  int c0,c1,r0,r1,r,c,k;
+  int found = 0;
+  int i,j,tmp;
+  double rad,dx,dy;
+
+  rad = sqrt(r2);
+  //also throws out NaN, which a wild pose can produce
+  if (!(x + rad >= grid->lx && x - rad <= grid->ux &&
+	y + rad >= grid->ly && y - rad <= grid->uy)) return 0;
+
+  c0 = (int) ((x - rad - grid->lx) * grid->inv_cell);
+  c1 = (int) ((x + rad - grid->lx) * grid->inv_cell);
+  r0 = (int) ((y - rad - grid->ly) * grid->inv_cell);
+  r1 = (int) ((y + rad - grid->ly) * grid->inv_cell);
+  if (c0 < 0) c0 = 0;
+  if (r0 < 0) r0 = 0;
+  if (c1 >= grid->cols) c1 = grid->cols - 1;
+  if (r1 >= grid->rows) r1 = grid->rows - 1;
+
+  for (r = r0; r <= r1; r++)
+    for (c = c0; c <= c1; c++) {
+      j = r * grid->cols + c;
+      for (k = grid->start[j]; k < grid->start[j+1]; k++) {
+	//same arithmetic as the brute force scans this replaces, so
+	//points right on the boundary land on the same side
+	dx = x - grid->x[k];
+	dx *= dx;
+	dy = y - grid->y[k];
+	dy *= dy;
+	dx += dy;
+	if (dx > r2) continue;
+	out[found++] = grid->index[k];
+      }
+    }
+
+  //result lists are short, insertion sort is all we need
+  for (i = 1; i < found; i++) {
+    tmp = out[i];
+    for (j = i - 1; j >= 0 && out[j] > tmp; j--) out[j+1] = out[j];
+    out[j+1] = tmp;
+  }
+  return found;
+}
+
+/*
+ * Find the k points nearest to (x,y), leaving out the point with index
+ * skip (pass -1 to keep them all). Indices go to out and squared
+ * distances to dist, both of which need room for k, closest first. Ties
+ * are broken by index, lowest first.
+ *
+ * Cells are searched in rings around the one holding (x,y). Any point
+ * not yet seen after ring r is at least r cells away, so the search
+ * stops once the kth best is closer than that.
+ *
+ * return : The number of points found, k unless the set is too small.
+ */
+int pointgrid_nearest(PointGrid grid, double x, double y, int k, int skip,
+		      int* out, double* dist)
+{
+  int found = 0;
+  int cx,cy,r,c,row,step,j,m,n;
+  double dx,dy,reach;
+
+  if (k <= 0 || grid->size == 0) return 0;
+  cx = (int) ((x - grid->lx) * grid->inv_cell);
+  cy = (int) ((y - grid->ly) * grid->inv_cell);
+  if (cx < 0) cx = 0;
+  if (cy < 0) cy = 0;
+  if (cx >= grid->cols) cx = grid->cols - 1;
+  if (cy >= grid->rows) cy = grid->rows - 1;
+
+  for (r = 0; ; r++) {
+    if (cx - r < 0 && cy - r < 0 && cx + r >= grid->cols &&
+	cy + r >= grid->rows) break; //every cell has been searched
+
+    for (row = cy - r; row <= cy + r; row++) {
+      if (row < 0 || row >= grid->rows) continue;
+      //top and bottom rows of the ring are whole, the rest just the ends
+      step = (row == cy - r || row == cy + r) ? 1 : 2 * r;
+      for (c = cx - r; c <= cx + r; c += step) {
+	if (c < 0 || c >= grid->cols) continue;
+	j = row * grid->cols + c;
+	for (m = grid->start[j]; m < grid->start[j+1]; m++) {
+	  if (grid->index[m] == skip) continue;
+	  dx = x - grid->x[m];
+	  dx *= dx;
+	  dy = y - grid->y[m];
+	  dy *= dy;
+	  dx += dy;
+	  //insert into the sorted list, if it makes the cut
+	  if (found == k && (dx > dist[k-1] ||
+			     (dx == dist[k-1] && grid->index[m] > out[k-1])))
+	    continue;
+	  n = found < k ? found++ : k - 1;
+	  while (n > 0 && (dist[n-1] > dx ||
+			   (dist[n-1] == dx && out[n-1] > grid->index[m]))) {
+	    dist[n] = dist[n-1];
+	    out[n] = out[n-1];
+	    n--;
+	  }
+	  dist[n] = dx;
+	  out[n] = grid->index[m];
+	}
+      }
+    }
+
+    reach = r * grid->cell;
+    if (found == k && dist[k-1] < reach * reach * (1.0 - 1e-12)) break;
+  }
+  return found;
+}
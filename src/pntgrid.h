@@ -0,0 +1,48 @@
+/**
+ * @file pntgrid.h
+ * @author Jason Denton
+ * @version 0.95
+ * @date May, 2009
+ *
+ * Copyright Jason Denton, 2009. This source code is made
+ * available under the terms of the new BSD license. See the file
+ * license.txt for the applicabe terms.
+ **/
+
+#ifndef _PNTGRID_H_
+#define _PNTGRID_H_
+
+#include "pntset.h"
+
+// A uniform grid laid over a point set. Points are bucketed by cell,
+// so a radius query only has to look at the handful of cells the
+// query circle touches instead of the whole set.
+
+typedef struct {
+  int size;
+  int cols, rows;
+  double lx, ly, ux, uy;
+  double cell;
+  double inv_cell;
+  int* start;     // cols*rows+1 offsets into index, one run per cell
+  int* index;     // point indices, ascending within each cell
+  double* x;      // point coordinates, in index order
+  double* y;
+} PointGridData;
+
+typedef PointGridData* PointGrid;
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+  PointGrid build_pointgrid(PointSet, double);
+  void free_pointgrid(PointGrid);
+  int pointgrid_within(PointGrid, double, double, double, int*);
+  int pointgrid_nearest(PointGrid, double, double, int, int, int*, double*);
+
+#ifdef __CPLUSPLUS
+}
+#endif
+
+#endif
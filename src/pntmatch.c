@@ -51,50 +51,43 @@ void print_match_html(FILE* fout, Match match)
   fprintf(fout,"\nPairs: %d Fitness: %8.4f</p>\n",j,match->error);
 }
 
-void compact_match(Match match)
+//Spread the match out so that m[i] = i for every model point, with
+//d[i] = -1 where model point i is unpaired. Done in place when the
+//arrays are big enough and the pairs are in ascending model order,
+//which is how store_match leaves them.
+void expand_match(Match match, int ms)
 {
-  int count = 0;
-  int i;
-  short *m;
-  short *d;
-
-  for (i = 0; i < match->size; i++)
-    if (match->m[i] != -1 && match->d[i] != -1) count++;
-    
-  
-  if (count == match->allocated) return;
+  int* m;
+  int* d;
+  int i,j,k,last;
   
-  m = (short*) malloc(sizeof(short) * count);
-  d = (short*) malloc(sizeof(short) * count);
-
-  count = 0;
-  for (i = 0; i < match->size; i++) {
-    if (match->m[i] == -1) continue;
-    if (match->d[i] == -1) continue;
-    m[count] = match->m[i];
-    d[count] = match->d[i];
-    count++;
-  }
-  if (match->allocated > 0) {
-    free(match->m);
-    free(match->d);
+  if (match->allocated >= ms) {
+    last = -1;
+    for (i = 0; i < match->size; i++) {
+      if (match->d[i] == -1) continue;
+      if (match->m[i] <= last || match->m[i] < i || match->m[i] >= ms)
+	break;
+      last = match->m[i];
+    }
+    if (i == match->size) {
+      //walk backward; m[i] >= i, so every slot written has been read
+      k = ms;
+      for (i = match->size - 1; i >= 0; i--) {
+	if (match->d[i] == -1) continue;
+	j = match->m[i];
+	match->d[j] = match->d[i];
+	for (j++; j < k; j++) match->d[j] = -1;
+	k = match->m[i];
+      }
+      for (j = 0; j < k; j++) match->d[j] = -1;
+      for (i = 0; i < ms; i++) match->m[i] = i;
+      match->size = ms;
+      return;
+    }
   }
-  match->m = m; 
-  match->d = d;
-  match->allocated = count;
-  match->size = count;
-  if (match->pose) free(match->pose);
-  match->pose = NULL;
-}
 
-void expand_match(Match match, int ms)
-{
-  short* m;
-  short* d;
-  int i;
-  
-  m = (short*) malloc(sizeof(short) * ms);
-  d = (short*) malloc(sizeof(short) * ms);
+  m = (int*) malloc(sizeof(int) * ms);
+  d = (int*) malloc(sizeof(int) * ms);
   
   for (i = 0; i < ms; i++) {
     m[i] = i; 
@@ -123,8 +116,8 @@ Match allocate_match(int alloc)
   match->size = 0;
   match->error = 0.0;
   match->pose = NULL;
-  match->m = (short*) malloc(sizeof(short) * alloc);
-  match->d = (short*) malloc(sizeof(short) * alloc);
+  match->m = (int*) malloc(sizeof(int) * alloc);
+  match->d = (int*) malloc(sizeof(int) * alloc);
 
   for(i = 0; i < alloc; i++) {
     match->m[i] = -1;
@@ -145,52 +138,65 @@ void free_match(Match match)
   free(match);
 }
 
-int compare_match(const void* m1, const void* m2)
+//Usual error ranking of matches, lowest error first. Matches within
+//0.005 of each other that make the same pairs compare equal.
+int match_order(Match match1, Match match2)
 {
   int i, nsame, ret;
   double diff;
-  Match* match1;
-  Match* match2;
 
   // deal with possiblity that match is null
   // null matches always greater than an instantiated match
   // helps with key feature ranking/memory saving scheme
   // by dumping null matches at end of list
-  
-  match1 = (Match*) m1;
-  match2 = (Match*) m2;
 
   //deal with null match
-  if (!(*match1) && !(*match2)) return 0;
-  if (!(*match1)) return 1;
-  if (!(*match2)) return -1;
+  if (!match1 && !match2) return 0;
+  if (!match1) return 1;
+  if (!match2) return -1;
 
   //set my return code based on absolute error
   //we MIGHT override if it looks like the difference
   //is just fp error.
-  if ((*match1)->error < (*match2)->error) ret = -1;
-  else if ((*match1)->error > (*match2)->error) ret =  1;
+  if (match1->error < match2->error) ret = -1;
+  else if (match1->error > match2->error) ret =  1;
   else ret = 0;
 
   //this is not exactly accurate, it assumed the
   //all model points appear in acesending order.
   //this should be the case in expanded format.
   //it should also be the case when an expanded match
-  //gets passed through compact_match.
-  diff = fabs((*match1)->error - (*match2)->error);
+  //is written back compacted by store_match.
+  diff = fabs(match1->error - match2->error);
   if (diff < 0.005) {
     i = 0; nsame = 0;
-    while (i < (*match1)->size && !nsame) {
-      if ((*match1)->m[i] != (*match2)->m[i]) nsame = 1;
-      if ((*match1)->d[i] != (*match2)->d[i]) nsame = 1;
+    while (i < match1->size && !nsame) {
+      if (match1->m[i] != match2->m[i]) nsame = 1;
+      if (match1->d[i] != match2->d[i]) nsame = 1;
       i++;
     } 
-    if (!ret && nsame) ret = (*match1)->size < (*match2)->size ? -1 : 1;
+    //different matches with the same error still need a consistent
+    //order, or sorting them depends on the sort. Use the first pair
+    //they differ on.
+    if (!ret && nsame) {
+      i--;
+      if (match1->size != match2->size)
+	ret = match1->size < match2->size ? -1 : 1;
+      else if (match1->m[i] != match2->m[i])
+	ret = match1->m[i] < match2->m[i] ? -1 : 1;
+      else ret = match1->d[i] < match2->d[i] ? -1 : 1;
+    }
     ret = ret * nsame;
   }
   return ret;
 }
 
+//match_order for qsort and friends, on a list of Match
+int compare_match(const void* m1, const void* m2)
+{
+  return match_order(*((Match*) m1),*((Match*) m2));
+}
+
 //Match is a reference type. Calls like ransac might completely
 //replace the contents of the match. This need to be reflected in the
 //reference.
@@ -383,3 +389,100 @@ Match copy_match(Match match)
   nm->trial_num = match->trial_num;
   return nm;
 }
+
+//Matches carved out of an arena, for scratch use inside a worker. They
+//have allocated set to 0 and go away with the arena, so they must never
+//be handed to free_match, replace_match or anything else that frees.
+Match arena_match(Arena arena, int alloc)
+{
+  Match match;
+  int i;
+
+  match = (Match) arena_alloc(arena,sizeof(MatchData));
+  match->allocated = 0;
+  match->size = 0;
+  match->error = 0.0;
+  match->pose = NULL;
+  match->trial_num = 0;
+  match->m = (int*) arena_alloc(arena,sizeof(int) * alloc);
+  match->d = (int*) arena_alloc(arena,sizeof(int) * alloc);
+
+  for(i = 0; i < alloc; i++) {
+    match->m[i] = -1;
+    match->d[i] = -1;
+  }
+
+  return match;
+}
+
+Match arena_copy_match(Arena arena, Match match)
+{
+  Match nm;
+
+  nm = arena_match(arena,match->size);
+  assign_match(nm,match);
+  nm->trial_num = match->trial_num;
+  return nm;
+}
+
+//An expanded arena copy of match, m[i] = i for every model point.
+//The pairs of match may be in any order.
+Match arena_expand_match(Arena arena, Match match, int ms)
+{
+  Match nm;
+  int i;
+
+  nm = arena_match(arena,ms);
+  for (i = 0; i < ms; i++) nm->m[i] = i;
+  for (i = 0; i < match->size; i++)
+    if (match->m[i] != -1 && match->d[i] != -1)
+      nm->d[match->m[i]] = match->d[i];
+  nm->size = ms;
+  nm->error = match->error;
+  nm->trial_num = match->trial_num;
+  return nm;
+}
+
+//Write the pairs of src back into match, compacted. The arrays of
+//match are reused when they have room, so a search that does not grow
+//the match needs no malloc.
+void store_match(Match match, Match src)
+{
+  int count = 0;
+  int i;
+
+  for (i = 0; i < src->size; i++)
+    if (src->m[i] != -1 && src->d[i] != -1) count++;
+  if (match->allocated < count) {
+    if (match->allocated > 0) {
+      free(match->m);
+      free(match->d);
+    }
+    match->m = (int*) malloc(sizeof(int) * count);
+    match->d = (int*) malloc(sizeof(int) * count);
+    match->allocated = count;
+  }
+  count = 0;
+  for (i = 0; i < src->size; i++) {
+    if (src->m[i] == -1 || src->d[i] == -1) continue;
+    match->m[count] = src->m[i];
+    match->d[count] = src->d[i];
+    count++;
+  }
+  match->size = count;
+  match->error = src->error;
+}
+
+//Copy the pairs and error of src into dst, which must already have
+//room for them. Unlike replace_match, src is left alone.
+void assign_match(Match dst, Match src)
+{
+  int i;
+
+  for (i = 0; i < src->size; i++) {
+    dst->m[i] = src->m[i];
+    dst->d[i] = src->d[i];
+  }
+  dst->size = src->size;
+  dst->error = src->error;
+}
@@ -13,6 +13,7 @@
 #define __PNTMATCH__
 
 #include <stdio.h>
+#include "arena.h"
 
 typedef double* Pose;
 
@@ -20,16 +21,28 @@ typedef struct {
   int size;
   int allocated;
   double error;
-  short* m;
-  short* d;
+  int* m;
+  int* d;
   Pose pose;
   int trial_num;
 } MatchData;
 
 typedef MatchData* Match;
 
+//Typed comparison for ranking matches, see match_order and best_matches.
+typedef int (*MatchOrder)(Match, Match);
+
 #define BAD_MATCH_PENALTY 1e20;
 
+//Packed occupancy bits, one per point, for telling which data points a
+//match already uses. Allocate BITSET_WORDS(n) words.
+typedef unsigned int* BitSet;
+
+#define BITSET_WORDS(n) (((n) + 31) >> 5)
+#define BIT_TEST(b,i) ((b)[(i) >> 5] & (1u << ((i) & 31)))
+#define BIT_SET(b,i) ((b)[(i) >> 5] |= (1u << ((i) & 31)))
+#define BIT_CLEAR(b,i) ((b)[(i) >> 5] &= ~(1u << ((i) & 31)))
+
 //function prototypes
 
 #ifdef __CPLUSPLUS
@@ -38,10 +51,10 @@ extern "C" {
 
   void print_match(Match);
   void print_match_html(FILE*,Match);  
-  void compact_match(Match);
   void expand_match(Match, int);
   Match allocate_match(int);
   void free_match(Match);
+  int match_order(Match, Match);
   int compare_match(const void*, const void*);
   void replace_match(Match, Match);
   void sort_match(Match);
@@ -51,6 +64,13 @@ extern "C" {
   Match merge_match(Match, Match);
   Match string_to_match(char*);
   Match copy_match(Match);
+  Match arena_match(Arena, int);
+  Match arena_copy_match(Arena, Match);
+  Match arena_expand_match(Arena, Match, int);
+  void store_match(Match, Match);
+  void assign_match(Match, Match);
+  void sort_matches(Match*, unsigned long, MatchOrder);
+  void best_matches(Match*, unsigned long, unsigned long, MatchOrder);
 
 #ifdef __CPLUSPLUS
 }
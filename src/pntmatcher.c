@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
 #include "pmproblem.h"
 #include "lsearch.h"
 #include "qt_heuristic.h"
@@ -24,38 +25,60 @@
 #include "random.h"
 #include "manual.h"
 
+//trials that run to the end whatever the deadline, see run_trials
+#define PM_FIRST_TRIALS 4
+
 /* These wrapper functions adapt individual search routines to the to
    the format needed by process_list. Mostly, they reuse a previosuly
    allocated scratch space for storing individual pose and then
    cleanup afterward. 
 */
 
-/* Notice the use of compact match. This is a costly (time wise)
-   operation. Worse, it hits malloc which is a multi-thread bottle
-   neck. The idea is that with large searches memory needs to be
-   saved. But note that in some cases all needed memory for the match
-   list will have already been obtained. */
+/* Results are built in an arena match and then copied to the heap at
+   their final, compacted size. Arena memory comes from the per-thread
+   context, so the only mallocs a worker makes per item are for the
+   result it hands back. The idea is that with large searches memory
+   needs to be saved, and malloc is a multi-thread bottle neck. Local
+   search runs on an expanded arena copy of the item and stores the
+   result back into the item's own arrays, which only mallocs when the
+   match has grown past them. */
 
 void* ls_wrapper(void* problem, void* scratch, void* item)
 {
-  ((Match)item)->pose = ((context_handle*)scratch)->pose;
-  local_search((PntMatchProblem)problem,(Match)item,(context_handle*)scratch);
-  ((Match)item)->pose = NULL;
-  //compact_match(item);
+  Match work;
+  Arena arena = ((context_handle*)scratch)->arena;
+
+  arena_reset(arena);
+  work = arena_expand_match(arena,(Match)item,
+			    ((PntMatchProblem)problem)->model->size);
+  work->pose = ((context_handle*)scratch)->pose;
+  local_search((PntMatchProblem)problem,work,(context_handle*)scratch);
+  work->pose = NULL;
+  note_trial_result((PntMatchProblem)problem,work);
+  store_match((Match)item,work);
   return item;
 }
 
 void* ransac_wrapper(void* extra, void* context, void* item)
 {
   Match result;
+  Match work;
+  Arena arena = ((RansacContext*)context)->ch->arena;
 
+  arena_reset(arena);
   ((Match)item)->pose = ((RansacContext*)context)->ch->pose;
-  result = allocate_match(((PntMatchProblem)extra)->model->size);
-  ransac_actual(extra,context,item,result);
+  work = arena_match(arena,((PntMatchProblem)extra)->model->size);
+  //screen the hypothesis, with points picked the same way whichever
+  //thread runs the trial
+  ((RansacContext*)context)->screen = ((PntMatchProblem)extra)->preemptive;
+  ((RansacContext*)context)->seed = ((Match)item)->trial_num + 1;
+  ransac_actual(extra,context,item,work);
   ((Match)item)->pose = NULL;
-  result->trial_num = ((Match)item)->trial_num;
+  work->trial_num = ((Match)item)->trial_num;
   free_match((Match)item);
-  compact_match(result);
+  note_trial_result((PntMatchProblem)extra,work);
+  note_ransac_trial((PntMatchProblem)extra,work);
+  result = copy_match(work);
   sort_match(result);
   return result;
 }
@@ -63,31 +86,82 @@ void* ransac_wrapper(void* extra, void* context, void* item)
 void* iransac_wrapper(void* extra, void* context, void* item)
 {
   Match result;
-  Match last;
+  Match work;
+  Arena arena = ((RansacContext*)context)->ch->arena;
 
+  arena_reset(arena);
   ((Match)item)->pose = ((RansacContext*)context)->ch->pose;
-  result = allocate_match(((PntMatchProblem)extra)->model->size);
-  result->pose = (Pose) malloc(sizeof(double) *
-			       ((PntMatchProblem)extra)->pose_dim);
-  last = copy_match((Match)item);
-  last->pose = (Pose) malloc(sizeof(double) *
-			       ((PntMatchProblem)extra)->pose_dim);
-  iransac_actual(extra,context,last,result);
+  work = arena_match(arena,((PntMatchProblem)extra)->model->size);
+  //screen the hypothesis, with points picked the same way whichever
+  //thread runs the trial
+  ((RansacContext*)context)->screen = ((PntMatchProblem)extra)->preemptive;
+  ((RansacContext*)context)->seed = ((Match)item)->trial_num + 1;
+  iransac_actual(extra,context,(Match)item,work);
   ((Match)item)->pose = NULL;
-  result->trial_num = ((Match)item)->trial_num;
+  work->trial_num = ((Match)item)->trial_num;
   free_match((Match)item);
-  free_match(last);
-  compact_match(result);
+  note_trial_result((PntMatchProblem)extra,work);
+  note_ransac_trial((PntMatchProblem)extra,work);
+  result = copy_match(work);
   sort_match(result);
   return result; 
 }
 
-Match* random_quarter_matches(PntMatchProblem problem, int trials)
+//Run the trials of lpo. The first few, the best since trials come in
+//priority order, always run to the end, even if the deadline has
+//passed, so that a search with a deadline has something to report. The
+//rest stop at the deadline; if it has passed already none are started.
+//
+//return : The results, in the order of the trials, NULL for trials that
+//were never started.
+Match* run_trials(PntMatchProblem problem, list_proc_obj lpo,
+		  unsigned long first)
+{
+  list_proc_obj part;
+  Match* searched;
+  Match* rest;
+  double deadline = problem->deadline;
+  unsigned long i;
+
+  if (first > lpo.list_size) first = lpo.list_size;
+  reset_search_state(problem);
+  lpo.cancel = &problem->cancel;
+  if (!first) {
+    search_cancelled(problem);
+    return (Match*) process_list(lpo);
+  }
+
+  searched = malloc_array(Match,lpo.list_size);
+  part = lpo;
+  part.list_size = first;
+  problem->deadline = 0.0;
+  rest = (Match*) process_list(part);
+  problem->deadline = deadline;
+  for (i = 0; i < first; i++) searched[i] = rest[i];
+  free(rest);
+
+  for (i = first; i < lpo.list_size; i++) searched[i] = NULL;
+  if (first < lpo.list_size) {
+    search_cancelled(problem);
+    part.list = lpo.list + first;
+    part.list_size = lpo.list_size - first;
+    rest = (Match*) process_list(part);
+    for (i = first; i < lpo.list_size; i++) searched[i] = rest[i - first];
+    free(rest);
+  }
+  return searched;
+}
+
+//Starting hypotheses for ransac and iransac. Guided ones come from the
+//key features, see guided_ransac_matches, unless there are too few.
+Match* random_quarter_matches(PntMatchProblem problem, int trials, int guided)
 {
   Match* matches;
-  char* qlist;
+  QuarterList qlist;
   int n;
   
+  if (guided && (matches = guided_ransac_matches(problem,trials)))
+    return matches;
   matches = malloc_array(Match,trials);
   qlist = quarter_pointset(problem->model);
   
@@ -95,7 +169,7 @@ Match* random_quarter_matches(PntMatchProblem problem, int trials)
     matches[n] = random_quarter_match(problem,qlist);
     matches[n]->trial_num = n;
   }
-  free(qlist);
+  free_quarter_list(qlist);
   return matches;
 }
 
@@ -114,13 +188,24 @@ int main(int argc, char** argv)
   PntMatchProblem problem;
   Match* matches;
   Match* searched;
-  unsigned long trials;
-  int i;
+  unsigned long trials,k;
+  int i,j;
   clock_t timer;
   clock_t total_rt;
   double seconds;
+  double deadline_ms = 0.0;
+  int guided = 0;
   list_proc_obj lpo;
 
+  //pull options out of the argument list, leaving the positional ones
+  for (i = j = 1; i < argc; i++) {
+    if (!strcmp(argv[i],"--deadline-ms") && i + 1 < argc)
+      deadline_ms = atof(argv[++i]);
+    else if (!strcmp(argv[i],"--guided")) guided = 1;
+    else argv[j++] = argv[i];
+  }
+  argc = j;
+
   if (argc < 2) {
     help();
     return 0;
@@ -139,6 +224,13 @@ int main(int argc, char** argv)
   if (argc > 2) trials = atoi(argv[2]);
   else trials = -1;
 
+  /* With a deadline the search runs trials in priority order until
+     time runs out, so the default is as many trials as we can
+     reasonably set up. The clock starts now, setting up the trials
+     counts against it, but only gets half of the budget: scoring key
+     features stops there, so that the best of them are still searched. */
+  if (deadline_ms > 0.0) set_search_deadline(problem,deadline_ms * 0.5);
+
   /*  Usual practice is to softlink the binary under different names.
       If the program is invoked under a different name, we use that to
       figure out which algorithm to use. Each algorithm has its own default
@@ -149,27 +241,31 @@ int main(int argc, char** argv)
   total_rt = clock();
 
   if (!strcmp(argv[0],"ransac")) {
-    if (trials == -1) trials = 1000;
+    if (trials == -1)
+      trials = deadline_ms > 0.0 || problem->confidence > 0.0 ? 10000 : 1000;
     timer = clock();
-    matches = random_quarter_matches(problem,trials);
+    matches = random_quarter_matches(problem,trials,guided);
     timer = clock() - timer;
     printf("\nRunning %lu trials of RANSAC.\n\n", trials); 
     lpo = get_list_proc_obj((void**)matches,trials,(void*)problem,
 			    ransac_wrapper);
     lpo.allocate_scratch_space = init_ransac_context;
     lpo.free_scratch_space = free_ransac_context;
+    lpo.cache_scratch = 1;
 
   }
   else if (!strcmp(argv[0],"iransac")) {
-    if (trials == -1) trials = 1000;
+    if (trials == -1)
+      trials = deadline_ms > 0.0 || problem->confidence > 0.0 ? 10000 : 1000;
     timer = clock();
-    matches = random_quarter_matches(problem,trials);
+    matches = random_quarter_matches(problem,trials,guided);
     timer = clock() - timer;
     printf("\nRunning %lu trials of iRANSAC.\n\n", trials);
     lpo = get_list_proc_obj((void**)matches,trials,(void*)problem,
 			    iransac_wrapper);
     lpo.allocate_scratch_space = init_ransac_context;
     lpo.free_scratch_space = free_ransac_context;
+    lpo.cache_scratch = 1;
 
   }
 
@@ -178,7 +274,7 @@ int main(int argc, char** argv)
      in the key feature routine itself; maybe not the best place for
      it. But having it there saves a processing step and some ram. */
   else if (!strcmp(argv[0],"pntmatch_rs")) {
-    if (trials == -1) trials = 1000;
+    if (trials == -1) trials = deadline_ms > 0.0 ? 10000 : 1000;
     timer = clock();
     matches = (Match*) malloc(sizeof(Match) * trials);
     for (i = 0; i < trials; i++) 
@@ -189,36 +285,66 @@ int main(int argc, char** argv)
     lpo = get_list_proc_obj((void**)matches,trials,(void*)problem,ls_wrapper);
     lpo.allocate_scratch_space = get_search_context;
     lpo.free_scratch_space = free_search_context;
+    lpo.cache_scratch = 1;
   }
 
   else {
     timer = clock();
+    if (trials == -1 && deadline_ms > 0.0) trials = 10000;
     matches = key_features(problem,problem->min_pairs+1,trials,&trials);
     timer = clock() - timer;
     printf("\nGot %lu key features for local search.\n", trials);
     lpo = get_list_proc_obj((void**)matches,trials,(void*)problem,ls_wrapper);
     lpo.allocate_scratch_space = get_search_context;
     lpo.free_scratch_space = free_search_context;
+    lpo.cache_scratch = 1;
   }
   
+  //the search gets the rest of the budget
+  if (deadline_ms > 0.0) problem->deadline += deadline_ms * 0.0005;
+
   //Timing report
   seconds = ((double)timer) / ((double)CLOCKS_PER_SEC);
   printf("Took %.3f seconds (%lu clock ticks) to generate all initial starting points.\n",seconds,timer);
   
   //The main event
   timer = clock();
-  searched = (Match*) process_list(lpo);
- 
+  searched = run_trials(problem,lpo,deadline_ms > 0.0 ? PM_FIRST_TRIALS : 0);
   timer = clock() - timer;
+  //trials never started, because the search was stopped early, come
+  //back NULL. Their starting points are still ours to free.
+  for (i = j = 0; i < trials; i++) {
+    if (searched[i]) searched[j++] = searched[i];
+    else free_match(matches[i]);
+  }
+  if (j < trials)
+    printf("Search stopped after %d of %lu trials.\n",j,trials);
+  if (problem->confidence > 0.0 && problem->best_pairs)
+    printf("Best trial found %d pairs, %.0f trials needed for %g "
+	   "confidence.\n",problem->best_pairs,
+	   ceil(ransac_trials_for_pairs(problem,problem->best_pairs,
+					problem->confidence)),
+	   problem->confidence);
+  trials = j;
   free(matches); matches=searched;
   seconds = ((double)timer) / ((double)CLOCKS_PER_SEC);
   printf("Spent %.3f seconds (%lu clock ticks) searching %lu trials.\n",seconds,
 	 timer,trials);
-  printf("Average trial time : %.3f seconds.\n",seconds/trials);
+  if (trials > 0)
+    printf("Average trial time : %.3f seconds.\n",seconds/trials);
   
-  //Sort the results
+  //Sort the results. Only the first few distinct ones get reported, so
+  //only the front of the list is put in order, growing it until it
+  //holds enough of them.
   timer = clock();
-  qsort_2t(matches,trials,sizeof(Match),sort_by_trial_num);
+  k = min(trials,4 * problem->instances);
+  for (;;) {
+    best_matches(matches,trials,k,match_trial_order);
+    if (k == trials ||
+	distinct_instances(matches,k,problem->instances) >= problem->instances)
+      break;
+    k = min(trials,2 * k);
+  }
   timer = clock() - timer;
   seconds = ((double)timer) / ((double)CLOCKS_PER_SEC);
   printf("Spent %.3f seconds sorting results.\n",seconds);
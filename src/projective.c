@@ -12,9 +12,15 @@
 #include <math.h>
 #include "pntset.h"
 #include "pntmatch.h"
+#include "pmproblem.h"
 
 #define max(X,Y) (((X) < (Y)) ? (Y) : (X))
 void solvps8(double*,double*);
+int ldl8_factor(double*,double*);
+int ldl8_update(double*,double*,double);
+void ldl8_solve(double*,double*);
+void ldl8_update_batch(double*,double*,double,int*);
+void ldl8_solve_batch(double*,double*);
 
 void transform_projective(double* x, double* y, Pose pose)
 {
@@ -27,6 +33,45 @@ void transform_projective(double* x, double* y, Pose pose)
   *x = tx/div; *y = ty/div;
 }
 
+//transform_projective over n points, with the same arithmetic. See
+//PM_TRANSFORM_KERNEL.
+PM_TRANSFORM_KERNEL
+void transform_batch_projective(double* restrict x, double* restrict y,
+				int n, Pose pose, double* restrict tx,
+				double* restrict ty)
+{
+  double p0 = pose[0], p1 = pose[1], p2 = pose[2], p3 = pose[3];
+  double p4 = pose[4], p5 = pose[5], p6 = pose[6], p7 = pose[7];
+  double u,v,div;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    u  = x[i] * p0; v  = x[i] * p3; div = 1.0 + x[i] * p6;
+    u += y[i] * p1; v += y[i] * p4; div += y[i] * p7;
+    u += p2;        v += p5;
+    tx[i] = u/div; ty[i] = v/div;
+  }
+}
+
+//transform_batch_projective in single precision.
+PM_TRANSFORM_KERNEL
+void transform_batch_float_projective(float* restrict x, float* restrict y,
+				      int n, Pose pose, float* restrict tx,
+				      float* restrict ty)
+{
+  float p0 = pose[0], p1 = pose[1], p2 = pose[2], p3 = pose[3];
+  float p4 = pose[4], p5 = pose[5], p6 = pose[6], p7 = pose[7];
+  float u,v,div;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    u  = x[i] * p0; v  = x[i] * p3; div = 1.0f + x[i] * p6;
+    u += y[i] * p1; v += y[i] * p4; div += y[i] * p7;
+    u += p2;        v += p5;
+    tx[i] = u/div; ty[i] = v/div;
+  }
+}
+
 double degeneracy_projective(PointSet model, Pose pose, double scale)
 {
   double x[4];
@@ -91,6 +136,60 @@ double degeneracy_projective(PointSet model, Pose pose, double scale)
   return scterm + vterm;
 }
 
+//Bound on one coordinate of the difference between poses p and q.
+//With n and d the numerator and denominator of that coordinate, the
+//difference is (np dq - nq dp) / (dp dq). The top is a quadratic in
+//x and y, bounded term by term for |x| <= X and |y| <= Y.
+static double shift_term(double* p, double* q, int row, double X, double Y)
+{
+  double c0,cx,cy,cxx,cxy,cyy;
+  double pa,pb,pc,qa,qb,qc;
+
+  pa = p[row]; pb = p[row+1]; pc = p[row+2];
+  qa = q[row]; qb = q[row+1]; qc = q[row+2];
+
+  c0 = pc - qc;
+  cx = pa - qa + pc * q[6] - qc * p[6];
+  cy = pb - qb + pc * q[7] - qc * p[7];
+  cxx = pa * q[6] - qa * p[6];
+  cxy = pa * q[7] + pb * q[6] - qa * p[7] - qb * p[6];
+  cyy = pb * q[7] - qb * p[7];
+
+  return fabs(c0) + fabs(cx) * X + fabs(cy) * Y + fabs(cxx) * X * X +
+    fabs(cxy) * X * Y + fabs(cyy) * Y * Y;
+}
+
+//Upper bound on the distance any point in the model's bounding box
+//moves when the pose changes from p to q. Returns HUGE_VAL if either
+//pose puts the line at infinity through the box.
+double pose_shift_projective(PointSet model, Pose p, Pose q)
+{
+  double X,Y,dp,dq,t,ex,ey;
+  double cx[4], cy[4];
+  int i;
+
+  cx[0] = model->lx; cy[0] = model->ly;
+  cx[1] = model->ux; cy[1] = model->ly;
+  cx[2] = model->ux; cy[2] = model->uy;
+  cx[3] = model->lx; cy[3] = model->uy;
+
+  //the denominators are linear, so the box corners hold their minimum
+  dp = 1e300; dq = 1e300;
+  for (i = 0; i < 4; i++) {
+    t = p[6] * cx[i] + p[7] * cy[i] + 1.0;
+    if (t < dp) dp = t;
+    t = q[6] * cx[i] + q[7] * cy[i] + 1.0;
+    if (t < dq) dq = t;
+  }
+  if (!(dp > 1e-6 && dq > 1e-6)) return HUGE_VAL;
+
+  X = max(fabs(model->lx),fabs(model->ux));
+  Y = max(fabs(model->ly),fabs(model->uy));
+  ex = shift_term(p,q,0,X,Y);
+  ey = shift_term(p,q,3,X,Y);
+  return sqrt(ex * ex + ey * ey) / (dp * dq);
+}
+
 void context_for_pair_projective(double x, double y,
 				 double u, double v, double* context)
 {
@@ -129,16 +228,13 @@ void context_for_pair_projective(double x, double y,
   context[22] = y * u2 + y * v2; //B7
 }
 
-void pose_from_partial_projective(double* context, Pose pose)
+//Unpack the 23 term context into the lower triangle of the 8x8 normal
+//matrix M and the right hand side B.
+void normal_from_partial_projective(double* context, double* M,
+				    double* B)
 {
-  double* M;
-  double* B;
-  int i;
   register double tmp;
 
-  M = context + 23;
-  B = M + 64;
-
   tmp = *context;
   M[0] = tmp; M[27] = tmp;
 
@@ -234,10 +330,229 @@ void pose_from_partial_projective(double* context, Pose pose)
   M[24] = 0.0; M[25] = 0.0; M[26] = 0.0;
   M[32] = 0.0; M[33] = 0.0; M[34] = 0.0;
   M[40] = 0.0; M[41] = 0.0; M[42] = 0.0;
+}
+
+void pose_from_partial_projective(double* context, Pose pose)
+{
+  double* M;
+  double* B;
+  int i;
+
+  M = context + 23;
+  B = M + 64;
 
+  normal_from_partial_projective(context,M,B);
   solvps8(M,B);
   for (i = 0; i < 8; i++) { 
     pose[i] = -B[i];
     if (pose[i] < 0.000000001 && pose[i] > -0.000000001) pose[i] = 0.0;
   }
 }
+
+/* Factored pose solution. Each pair adds two rows to the least squares
+   system behind the normal matrix,
+     r1 = ( x  y  1  0  0  0  -ux  -uy )
+     r2 = ( 0  0  0  x  y  1  -vx  -vy )
+   so adding or removing a pair is a rank two change to M. Local search
+   keeps the LDL' factor of M for the current match and folds candidate
+   pairs in and out of it, instead of rebuilding and refactoring M for
+   every move. */
+
+//Factor the normal matrix of a full context. Returns 0 if M is not
+//safely positive definite, in which case the factor is unusable.
+int factor_from_partial_projective(double* context, double* factor)
+{
+  double* M;
+  double* B;
+
+  M = context + 23;
+  B = M + 64;
+  normal_from_partial_projective(context,M,B);
+  return ldl8_factor(M,factor);
+}
+
+//Add (sign = 1) or remove (sign = -1) the pair x,y -> u,v from the
+//factor. Returns 0 if the result can't be trusted, which is the usual
+//outcome when removing a pair leaves too few pairs to fix the pose.
+int factor_pair_projective(double* factor, double x, double y,
+			   double u, double v, double sign)
+{
+  double w[8];
+
+  w[0] = x; w[1] = y; w[2] = 1.0;
+  w[3] = 0.0; w[4] = 0.0; w[5] = 0.0;
+  w[6] = -u * x; w[7] = -u * y;
+  if (!ldl8_update(factor,w,sign)) return 0;
+
+  w[0] = 0.0; w[1] = 0.0; w[2] = 0.0;
+  w[3] = x; w[4] = y; w[5] = 1.0;
+  w[6] = -v * x; w[7] = -v * y;
+  return ldl8_update(factor,w,sign);
+}
+
+//Same as pose_from_partial_projective, with the factor of M already in
+//hand. Only the right hand side is taken from the context.
+void pose_from_factor_projective(double* factor, double* context, Pose pose)
+{
+  double B[8];
+  int i;
+
+  B[0] = context[9];  B[1] = context[10]; B[2] = context[19];
+  B[3] = context[14]; B[4] = context[15]; B[5] = context[20];
+  B[6] = context[21]; B[7] = context[22];
+
+  ldl8_solve(factor,B);
+  for (i = 0; i < 8; i++) { 
+    pose[i] = -B[i];
+    if (pose[i] < 0.000000001 && pose[i] > -0.000000001) pose[i] = 0.0;
+  }
+}
+
+//context_for_pair_projective for the model point x,y paired with each of
+//the PM_BATCH data points u[k],v[k]. Term j of lane k goes to
+//context[j*PM_BATCH+k]. The arithmetic is the same as the scalar version.
+void context_for_pairs_batch_projective(double x, double y, double* u,
+					double* v, double* context)
+{
+  double x2,y2,xy,u2,v2,nu,nv;
+  int k;
+
+  x2 = x * x;
+  y2 = y * y;
+  xy = x * y;
+  for (k = 0; k < PM_BATCH; k++) {
+    u2 = u[k] * u[k];
+    v2 = v[k] * v[k];
+    nu = -u[k];
+    nv = -v[k];
+    context[0*PM_BATCH+k] = x2;
+    context[1*PM_BATCH+k] = xy;
+    context[2*PM_BATCH+k] = x;
+    context[3*PM_BATCH+k] = x2 * nu;
+    context[4*PM_BATCH+k] = xy * nu;
+    context[5*PM_BATCH+k] = y2;
+    context[6*PM_BATCH+k] = y;
+    context[7*PM_BATCH+k] = y2 * nu;
+    context[8*PM_BATCH+k] = 1.0;
+    context[9*PM_BATCH+k] = x * nu;
+    context[10*PM_BATCH+k] = y * nu;
+    context[11*PM_BATCH+k] = x2 * nv;
+    context[12*PM_BATCH+k] = xy * nv;
+    context[13*PM_BATCH+k] = y2 * nv;
+    context[14*PM_BATCH+k] = x * nv;
+    context[15*PM_BATCH+k] = y * nv;
+    context[16*PM_BATCH+k] = x2 * u2 + x2 * v2;
+    context[17*PM_BATCH+k] = xy * u2 + xy * v2;
+    context[18*PM_BATCH+k] = y2 * u2 + y2 * v2;
+    context[19*PM_BATCH+k] = nu;
+    context[20*PM_BATCH+k] = nv;
+    context[21*PM_BATCH+k] = x * u2 + x * v2;
+    context[22*PM_BATCH+k] = y * u2 + y * v2;
+  }
+}
+
+//Poses for partial + each lane of a batched context, written one after
+//another to poses. Factor is the factor of partial's normal matrix; each
+//lane adds its pair to a copy of it, as factor_pair_projective would.
+//Returns a bit mask of the lanes solved. Lanes left out (all of them if
+//there is no factor) must be solved by the caller with
+//pose_from_partial_projective.
+int pose_from_partial_batch_projective(double* factor, double* partial,
+				       double* context, double* poses)
+{
+  double F[72*PM_BATCH];
+  double w[8*PM_BATCH];
+  double B[8*PM_BATCH];
+  int ok[PM_BATCH];
+  static const int bterm[8] = {9, 10, 19, 14, 15, 20, 21, 22};
+  int i,k,mask;
+
+  if (!factor) return 0;
+  for (i = 0; i < 72; i++)
+    for (k = 0; k < PM_BATCH; k++) F[i*PM_BATCH+k] = factor[i];
+  for (k = 0; k < PM_BATCH; k++) ok[k] = 1;
+
+  //the two rows the pair adds to the design matrix, as in
+  //factor_pair_projective
+  for (k = 0; k < PM_BATCH; k++) {
+    w[0*PM_BATCH+k] = context[2*PM_BATCH+k];
+    w[1*PM_BATCH+k] = context[6*PM_BATCH+k];
+    w[2*PM_BATCH+k] = context[8*PM_BATCH+k];
+    w[3*PM_BATCH+k] = 0.0;
+    w[4*PM_BATCH+k] = 0.0;
+    w[5*PM_BATCH+k] = 0.0;
+    w[6*PM_BATCH+k] = context[9*PM_BATCH+k];
+    w[7*PM_BATCH+k] = context[10*PM_BATCH+k];
+  }
+  ldl8_update_batch(F,w,1.0,ok);
+  for (k = 0; k < PM_BATCH; k++) {
+    w[0*PM_BATCH+k] = 0.0;
+    w[1*PM_BATCH+k] = 0.0;
+    w[2*PM_BATCH+k] = 0.0;
+    w[3*PM_BATCH+k] = context[2*PM_BATCH+k];
+    w[4*PM_BATCH+k] = context[6*PM_BATCH+k];
+    w[5*PM_BATCH+k] = context[8*PM_BATCH+k];
+    w[6*PM_BATCH+k] = context[14*PM_BATCH+k];
+    w[7*PM_BATCH+k] = context[15*PM_BATCH+k];
+  }
+  ldl8_update_batch(F,w,1.0,ok);
+
+  for (i = 0; i < 8; i++)
+    for (k = 0; k < PM_BATCH; k++)
+      B[i*PM_BATCH+k] = partial[bterm[i]] + context[bterm[i]*PM_BATCH+k];
+  ldl8_solve_batch(F,B);
+
+  mask = 0;
+  for (k = 0; k < PM_BATCH; k++) {
+    if (!ok[k]) continue;
+    mask |= 1 << k;
+    for (i = 0; i < 8; i++) {
+      poses[k*8+i] = -B[i*PM_BATCH+k];
+      if (poses[k*8+i] < 0.000000001 && poses[k*8+i] > -0.000000001)
+	poses[k*8+i] = 0.0;
+    }
+  }
+  return mask;
+}
+
+//determinant of the homogeneous points i, j and k of a cluster
+double cluster_det(PointSet pset, int* cluster, int i, int j, int k)
+{
+  double *x = pset->x, *y = pset->y;
+
+  i = cluster[i]; j = cluster[j]; k = cluster[k];
+  return x[i] * (y[j] - y[k]) - y[i] * (x[j] - x[k]) +
+    (x[j] * y[k] - x[k] * y[j]);
+}
+
+//Signature of an ordered cluster that projective transforms leave alone:
+//the log magnitudes of the two classic invariants of five coplanar
+//points, each a ratio of products of triangle determinants. If any of
+//the triangles is close to flat the invariants are dominated by noise,
+//and the cluster is given no signature rather than a wrong one.
+//
+//return : The number of values in sig, 0 if the cluster has none.
+int cluster_invariant_projective(PointSet pset, int* cluster, int size,
+				 double* sig)
+{
+  double d[6];
+  double lo,hi;
+  int i;
+
+  if (size < 5) return 0;
+  d[0] = cluster_det(pset,cluster,3,2,0); //m431
+  d[1] = cluster_det(pset,cluster,4,1,0); //m521
+  d[2] = cluster_det(pset,cluster,3,1,0); //m421
+  d[3] = cluster_det(pset,cluster,4,2,0); //m531
+  d[4] = cluster_det(pset,cluster,4,2,1); //m532
+  d[5] = cluster_det(pset,cluster,3,2,1); //m432
+  lo = hi = fabs(d[0]);
+  for (i = 1; i < 6; i++) {
+    if (fabs(d[i]) < lo) lo = fabs(d[i]);
+    if (fabs(d[i]) > hi) hi = fabs(d[i]);
+  }
+  if (!(lo > 0.01 * hi)) return 0;
+  sig[0] = log(fabs(d[0] * d[1] / (d[2] * d[3])));
+  sig[1] = log(fabs(d[2] * d[4] / (d[5] * d[1])));
+  return 2;
+}
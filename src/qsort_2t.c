@@ -10,43 +10,249 @@
  **/
 
 #include <stdlib.h>
-#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 
-int number_of_processors(void);
+#include "jadmulti.h"
+#include "jadmath.h"
+
+//runs this short are insertion sorted before merging starts
+#define QS_SMALL 16
+//lists shorter than this are not worth handing to the pool
+#define QS_PARALLEL 4096
+
+typedef int (*qsort_cmp)(const void*, const void*);
 
 typedef struct
 {
-  void* base;
+  char* list;
+  char* buffer;
   size_t numel;
   size_t szof;
-  int (*cmpfunc)(const void*, const void*);
+  qsort_cmp cmpfunc;
+  int np;
+  size_t* run;    //run i is [run[i],run[i+1])
+  size_t* split;  //part p takes [split[p*np+i],split[(p+1)*np+i]) of run i
 } qsort_mt_data;
 
-void* qsort_mt_thread_func(void* p)
+//a candidate splitter: element pos, which lies in run
+typedef struct
+{
+  int run;
+  size_t pos;
+} qsort_mt_sample;
+
+void insertion_sort_bytes(char* base, size_t n, size_t szof,
+			  qsort_cmp cmpfunc, char* tmp)
+{
+  size_t i,j;
+
+  for (i = 1; i < n; i++) {
+    j = i;
+    while (j > 0 && cmpfunc(base+(j-1)*szof,base+i*szof) > 0) j--;
+    if (j == i) continue;
+    memcpy(tmp,base+i*szof,szof);
+    memmove(base+(j+1)*szof,base+j*szof,(i-j)*szof);
+    memcpy(base+j*szof,tmp,szof);
+  }
+}
+
+/*
+ * Stable merge of the sorted lists a (na elements) and b (nb elements)
+ * into out. On ties a goes first.
+ */
+void merge_bytes(char* a, size_t na, char* b, size_t nb, size_t szof,
+		 qsort_cmp cmpfunc, char* out)
+{
+  char* ea = a + na * szof;
+  char* eb = b + nb * szof;
+
+  while (a < ea && b < eb) {
+    if (cmpfunc(b,a) < 0) { memcpy(out,b,szof); b += szof; }
+    else { memcpy(out,a,szof); a += szof; }
+    out += szof;
+  }
+  if (a < ea) memcpy(out,a,ea-a);
+  if (b < eb) memcpy(out,b,eb-b);
+}
+
+/*
+ * Stable merge sort of n elements at base, using buffer (room for n
+ * elements) as scratch.
+ */
+void merge_sort_bytes(char* base, size_t n, size_t szof, qsort_cmp cmpfunc,
+		      char* buffer)
+{
+  char* from;
+  char* to;
+  char* tmp;
+  size_t w,lo,mid,hi;
+
+  //buffer is free until the first merge, use it for the insertion swaps
+  for (lo = 0; lo < n; lo += QS_SMALL)
+    insertion_sort_bytes(base+lo*szof,min(QS_SMALL,n-lo),szof,cmpfunc,buffer);
+
+  from = base;
+  to = buffer;
+  for (w = QS_SMALL; w < n; w *= 2) {
+    for (lo = 0; lo < n; lo += 2 * w) {
+      mid = min(lo + w,n);
+      hi = min(lo + 2 * w,n);
+      merge_bytes(from+lo*szof,mid-lo,from+mid*szof,hi-mid,szof,cmpfunc,
+		  to+lo*szof);
+    }
+    tmp = from; from = to; to = tmp;
+  }
+  if (from != base) memcpy(base,from,n*szof);
+}
+
+//sorts run id of the list
+void qsort_mt_sort_func(void* p, int id)
+{
+  qsort_mt_data* q = (qsort_mt_data*) p;
+
+  merge_sort_bytes(q->list+q->run[id]*q->szof,q->run[id+1]-q->run[id],
+		   q->szof,q->cmpfunc,q->buffer+q->run[id]*q->szof);
+}
+
+//where part id of the output starts
+size_t qsort_mt_part_start(qsort_mt_data* q, int id)
+{
+  size_t start = 0;
+  int i;
+
+  for (i = 0; i < q->np; i++) start += q->split[id*q->np+i] - q->run[i];
+  return start;
+}
+
+//merges the slices of every run that belong to part id of the output
+void qsort_mt_merge_func(void* p, int id)
+{
+  qsort_mt_data* q = (qsort_mt_data*) p;
+  size_t* at = q->split + id * q->np;
+  size_t* end = q->split + (id + 1) * q->np;
+  size_t pos[64];
+  char* out;
+  int i,best;
+
+  out = q->buffer + qsort_mt_part_start(q,id) * q->szof;
+  for (i = 0; i < q->np; i++) pos[i] = at[i];
+  for (;;) {
+    //the lowest run wins ties, which keeps the merge stable
+    best = -1;
+    for (i = 0; i < q->np; i++) {
+      if (pos[i] == end[i]) continue;
+      if (best == -1 || q->cmpfunc(q->list+pos[i]*q->szof,
+				   q->list+pos[best]*q->szof) < 0) best = i;
+    }
+    if (best == -1) break;
+    memcpy(out,q->list+pos[best]*q->szof,q->szof);
+    out += q->szof;
+    pos[best]++;
+  }
+}
+
+//copies part id of the merged output back over the list
+void qsort_mt_copy_func(void* p, int id)
+{
+  qsort_mt_data* q = (qsort_mt_data*) p;
+  size_t lo,hi;
+
+  lo = qsort_mt_part_start(q,id);
+  hi = id == q->np - 1 ? q->numel : qsort_mt_part_start(q,id+1);
+  memcpy(q->list+lo*q->szof,q->buffer+lo*q->szof,(hi-lo)*q->szof);
+}
+
+//The order of the merge: by value, then by run, then by position.
+//Equal values keep their original order, since runs are in list order.
+int qsort_mt_sample_order(qsort_mt_data* q, qsort_mt_sample* a,
+			  qsort_mt_sample* b)
+{
+  int c;
+
+  c = q->cmpfunc(q->list+a->pos*q->szof,q->list+b->pos*q->szof);
+  if (c) return c;
+  if (a->run != b->run) return a->run < b->run ? -1 : 1;
+  if (a->pos != b->pos) return a->pos < b->pos ? -1 : 1;
+  return 0;
+}
+
+/*
+ * The number of elements of run i that come before splitter s in merge
+ * order. Runs before the splitter's own give up their ties to the left,
+ * runs after it keep them on the right.
+ */
+size_t qsort_mt_rank(qsort_mt_data* q, int i, qsort_mt_sample* s)
+{
+  size_t lo,hi,mid;
+  char* key;
+  int c;
+
+  if (i == s->run) return s->pos;
+  key = q->list + s->pos * q->szof;
+  lo = q->run[i];
+  hi = q->run[i+1];
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    c = q->cmpfunc(q->list+mid*q->szof,key);
+    if (c < 0 || (c == 0 && i < s->run)) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Pick np-1 splitters by regular sampling of the sorted runs, and cut
+ * every run at each of them.
+ */
+void qsort_mt_splitters(qsort_mt_data* q)
 {
-  qsort_mt_data* parms;
-  parms = p;
- 
-  qsort(parms->base,parms->numel,parms->szof,parms->cmpfunc);
-  return NULL;
+  qsort_mt_sample* sample;
+  qsort_mt_sample tmp;
+  int np = q->np;
+  int ns,i,j,t,p;
+  size_t len;
+
+  ns = np * (np - 1);
+  sample = (qsort_mt_sample*) malloc(sizeof(qsort_mt_sample) * ns);
+  for (i = 0, j = 0; i < np; i++) {
+    len = q->run[i+1] - q->run[i];
+    for (t = 1; t < np; t++, j++) {
+      sample[j].run = i;
+      sample[j].pos = q->run[i] + len * t / np;
+    }
+  }
+  for (i = 1; i < ns; i++) {
+    tmp = sample[i];
+    for (j = i; j > 0 && qsort_mt_sample_order(q,sample+j-1,&tmp) > 0; j--)
+      sample[j] = sample[j-1];
+    sample[j] = tmp;
+  }
+
+  for (i = 0; i < np; i++) {
+    q->split[i] = q->run[i];
+    q->split[np*np+i] = q->run[i+1];
+  }
+  for (p = 1; p < np; p++)
+    for (i = 0; i < np; i++)
+      q->split[p*np+i] = qsort_mt_rank(q,i,sample+p*ns/np);
+  free(sample);
 }
 
 /**
  * @brief Multi-threaded replacement for qsort.
  *
- * Multi-threaded qsort routine. Sub-divides list and hands of the
- * pieces to one thread per CPU for sorting. After each thread
- * terminates the main thread merges the list (a linear operation). On
- * short lists (25 elements of less) this routine just calls qsort.
+ * A stable parallel merge sort. The list is cut into one run per thread
+ * of the process_list pool, and each thread merge sorts its run. Then
+ * splitters are chosen by regular sampling of the sorted runs, which
+ * cuts every run into one slice per thread, and each thread merges its
+ * slices of all the runs straight into its own part of the output.
+ * Short lists, or calls made while the pool is busy, are merge sorted in
+ * the calling thread.
  *
- * On SMP systems with M process performance should be N/2 * log(N/2) +
- * + N + C where C is a over head for spawning M-1 threads. Note that this
- * is wall clock time, not processor time.
- *
- * This implementation is suitable as the basis for a true multi-process qsort.
- * However, the final merge sort at the end needs to be multi-threaded first.
- * The runtime return for this is minimal, and probably not worth the effort.
+ * Unlike qsort the sort is stable: elements that compare equal stay in
+ * the order they were in. The name is historical; this used to sort
+ * with exactly two threads and merge serially.
  *
  * @param list The list to be sorted.
  * @param numel The number of elements on the list.
@@ -56,91 +262,35 @@ void* qsort_mt_thread_func(void* p)
 
 void qsort_2t(void* list, size_t numel, size_t szof,
 	      int (*cmpfunc)(const void*,const void*)) {
-  int np;
-  int* nel;
-  char** start;
-  int i,ex;
-  pthread_t* tids;
-  qsort_mt_data* parms;
-  char* buffer;
-  int npos = 0;
-  int base;
-  char* list_as_char;
-  int next_taken;
-  
-  np = number_of_processors();
-  //do regular qsort if only one processor
-   if (np == 1 || numel < 50) {
-     qsort(list,numel,szof,cmpfunc);
+  qsort_mt_data q;
+  int np,i;
+
+  if (numel < 2 || szof == 0) return;
+  q.list = (char*) list;
+  q.buffer = (char*) malloc(numel * szof);
+  q.numel = numel;
+  q.szof = szof;
+  q.cmpfunc = cmpfunc;
+
+  np = pool_threads();
+  if (np > 64) np = 64; //the merge keeps its run positions on the stack
+  if (np == 1 || numel < QS_PARALLEL) {
+    merge_sort_bytes(q.list,numel,szof,cmpfunc,q.buffer);
+    free(q.buffer);
     return;
-     }
-  
-  np = 2; //force this to only use 2 processors,
-
-  //determine the number of elements each thread should sort
-  base = numel / np;
-  ex = numel % np;
-  nel = (int*) malloc(sizeof(int) * np);
-  for (i = 0; i < np; i++) {
-    nel[i] = base;
-    if (ex) {
-      nel[i]++;
-      ex--;
-    }
   }
 
-  //determine start point of each sorting function
-  start = (char**) malloc(sizeof(void*) * np);
-  start[0] = list;
-  for (i = 1; i < np; i++)
-    start[i] = start[i-1] + (nel[i-1]*szof);
-  
-  tids = (pthread_t*) malloc(sizeof(pthread_t) * (np-1));
-  parms = (qsort_mt_data*) malloc(sizeof(qsort_mt_data) * (np-1));
-  for (i = 1; i < np; i++) {
-    parms[i-1].base = start[i];
-    parms[i-1].numel = nel[i];
-    parms[i-1].szof = szof;
-    parms[i-1].cmpfunc = cmpfunc;
-    pthread_create(tids+(i-1),NULL,qsort_mt_thread_func,parms+(i-1));
-  }
-  qsort(start[0],nel[0],szof,cmpfunc);
-  
-
-  for (i = 0; i < (np-1); i++)
-    pthread_join(tids[i],NULL);
-  
-  base = 0;
-  buffer = (char*) malloc(numel * szof);
-
-  //to get true multiprocess qsort for n threads, replace this
-  //code to merge lists
-  do {
-    //determine the lowest top element
-    next_taken = 0;
-    while (!nel[next_taken]) next_taken++;
-    for (i = next_taken; i < np; i++) {
-      if (!nel[i]) continue; 
-      if (cmpfunc(start[next_taken],start[i]) == 1)
-		next_taken = i;
-    }
-    //copy element into new buffer
-    for (i = 0; i < szof; i++)
-      buffer[base+i] = start[next_taken][i];
-    nel[next_taken]--;
-    start[next_taken] += szof;
-    npos++; 
-    base += szof;
-  } while (npos < numel);
-
-  list_as_char = (char*) list;
-  for (i = 0; i < numel * szof; i++)
-    list_as_char[i] = buffer[i];
-
-  free(buffer);
-  free(start);
-  free(nel);
-  free(tids);
-  free(parms);
+  q.np = np;
+  q.run = (size_t*) malloc(sizeof(size_t) * (np + 1));
+  q.split = (size_t*) malloc(sizeof(size_t) * (np + 1) * np);
+  for (i = 0; i <= np; i++) q.run[i] = numel * i / np;
+
+  run_on_pool(qsort_mt_sort_func,&q,np);
+  qsort_mt_splitters(&q);
+  run_on_pool(qsort_mt_merge_func,&q,np);
+  run_on_pool(qsort_mt_copy_func,&q,np);
 
+  free(q.split);
+  free(q.run);
+  free(q.buffer);
 }
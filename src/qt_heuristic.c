@@ -16,19 +16,23 @@
 */
 
 #include <stdlib.h>
+#include <math.h>
 #include "pntset.h"
 #include "pntmatch.h"
 #include "pmproblem.h"
 #include "matcheqpose.h"
 #include "jadutil.h"
 #include "random.h"
+#include "lsearch.h"
+#include "qt_heuristic.h"
 
 struct quarter_helper {
-  int x;
-  int y;
+  double x;
+  double y;
   int orig_pos;
 };
 
+//ties go by position, so the split doesn't depend on the qsort
 int comp_x(const void* d1, const void* d2)
 {
   struct quarter_helper* qh1;
@@ -39,7 +43,7 @@ int comp_x(const void* d1, const void* d2)
 
   if (qh1->x < qh2->x) return -1;
   else if (qh1->x > qh2->x) return 1;
-  else return 0;
+  else return qh1->orig_pos - qh2->orig_pos;
 }
 
 int comp_y(const void* d1, const void* d2)
@@ -52,17 +56,21 @@ int comp_y(const void* d1, const void* d2)
 
   if (qh1->y < qh2->y) return -1;
   else if (qh1->y > qh2->y) return 1;
-  else return 0;
+  else return qh1->orig_pos - qh2->orig_pos;
 }
 
-// returns an array such each that element gives the quadrant that the
-//corresponding element of pset is in.
-
-char* quarter_pointset(PointSet pset)
+// Splits pset into quadrants at the median x and median y, and returns
+// the indices of the points bucketed by quadrant, so that drawing a
+// point from a quadrant takes constant time. Quadrant q holds the points
+// with bit 0 of q set if in the upper half by x, and bit 1 if in the
+// upper half by y.
+QuarterList quarter_pointset(PointSet pset)
 {
-  int i;
+  int i,q;
   char* qlist;
+  int fill[4];
   struct quarter_helper* proxy;
+  QuarterList ql;
 
   qlist = (char*) malloc(sizeof(char) * pset->size);
   proxy = (struct quarter_helper*) malloc(sizeof(struct quarter_helper) * 
@@ -82,30 +90,47 @@ char* quarter_pointset(PointSet pset)
   for (i = pset->size/2; i < pset->size; i++)
     qlist[proxy[i].orig_pos] += 2;
 
+  ql = (QuarterList) malloc(sizeof(QuarterListData));
+  ql->size = pset->size;
+  ql->index = malloc_array(int,pset->size);
+  for (q = 0; q <= 4; q++) ql->start[q] = 0;
+  for (i = 0; i < pset->size; i++) ql->start[qlist[i]+1]++;
+  for (q = 0; q < 4; q++) {
+    ql->start[q+1] += ql->start[q];
+    fill[q] = ql->start[q];
+  }
+  for (i = 0; i < pset->size; i++) ql->index[fill[(int) qlist[i]]++] = i;
+
   free(proxy);
-  return qlist;
+  free(qlist);
+  return ql;
+}
+
+void free_quarter_list(QuarterList ql)
+{
+  if (!ql) return;
+  free(ql->index);
+  free(ql);
 }
 
 // Generates a random match, such that the four initial model points are
 // drawn from each of the four quadrants of the image plane.
-// This is a heuristic for ransac.
-Match random_quarter_match(PntMatchProblem problem, char* qlist)
+// This is a heuristic for ransac. A quadrant with no points in it (the
+// model has fewer than four, or many share a coordinate) is drawn from
+// the whole model instead.
+Match random_quarter_match(PntMatchProblem problem, QuarterList ql)
 {
   Match match;
-  int i,j,k;
+  int i,n;
 
     match = allocate_match(4);
     match->size = 4;
     match->error = problem->model->size - 4.0;
     
     for (i = 0; i < 4; i++) {
-      k = randint(problem->model->size-1) + 1;
-      j = -1;
-      do {
-	j = (j + 1) % problem->model->size;
-	if (qlist[j] == i) k--;
-      } while (k);
-      match->m[i] = j;
+      n = ql->start[i+1] - ql->start[i];
+      if (n) match->m[i] = ql->index[ql->start[i] + randint(n)];
+      else match->m[i] = randint(ql->size);
       match->d[i] = random() % problem->data->size;  
     }
 
@@ -113,3 +138,147 @@ Match random_quarter_match(PntMatchProblem problem, char* qlist)
 }
 
 
+//a correspondence and where it was first seen in the key feature list
+struct guided_pair {
+  int m;
+  int d;
+  int rank;
+};
+
+//same pair next to each other, earliest first
+int comp_pair(const void* d1, const void* d2)
+{
+  struct guided_pair* gp1;
+  struct guided_pair* gp2;
+
+  gp1 = (struct guided_pair*) d1;
+  gp2 = (struct guided_pair*) d2;
+
+  if (gp1->m != gp2->m) return gp1->m - gp2->m;
+  if (gp1->d != gp2->d) return gp1->d - gp2->d;
+  return gp1->rank - gp2->rank;
+}
+
+int comp_rank(const void* d1, const void* d2)
+{
+  return ((struct guided_pair*) d1)->rank - ((struct guided_pair*) d2)->rank;
+}
+
+//Draw an index into the first n correspondences whose model and data
+//points are not already in the first k pairs of the match. Gives up
+//after a while, so a short list can't hang us, and takes the last draw.
+int draw_guided_pair(Match match, int k, int* cm, int* cd, int n)
+{
+  int tries,i,c;
+
+  for (tries = 0; tries < 100; tries++) {
+    c = randint(n);
+    for (i = 0; i < k; i++)
+      if (match->m[i] == cm[c] || match->d[i] == cd[c]) break;
+    if (i == k) break;
+  }
+  return c;
+}
+
+// PROSAC style guided hypotheses for ransac. Candidate correspondences
+// are ranked by the key features they come from (see keyfeat.c): the
+// pairs of the best key feature first, then any new pairs of the
+// second, and so on. Trial t draws its four pairs from the top n(t)
+// correspondences only, where n grows on the PROSAC schedule from 4 to
+// the whole list by the last trial, so the early trials are spent on
+// the likeliest pairs and the later ones approach uniform sampling of
+// the list.
+//
+// return : A list of trials matches, or NULL if the key features give
+// fewer than four correspondences.
+Match* guided_ransac_matches(PntMatchProblem problem, int trials)
+{
+  Match* features;
+  Match match;
+  unsigned long nf,f;
+  struct guided_pair* gp;
+  int* cm;
+  int* cd;
+  int ms,n,N,i,j,t,tp,k;
+  double tn,tn1;
+
+  ms = problem->model->size;
+  features = key_features(problem,problem->min_pairs+1,trials,&nf);
+
+  //rank the correspondences: list them all in key feature order, sort
+  //so that repeats are next to each other, keep the first of each and
+  //put those back in order
+  //each key feature has min_pairs+1 pairs
+  for (f = 0, N = 0; f < nf; f++) N += features[f]->size;
+  gp = malloc_array(struct guided_pair,N + 1);
+  N = 0;
+  for (f = 0; f < nf; f++) {
+    for (i = 0; i < features[f]->size; i++) {
+      if (features[f]->d[i] == -1) continue;
+      gp[N].m = features[f]->m[i];
+      gp[N].d = features[f]->d[i];
+      gp[N].rank = N;
+      N++;
+    }
+    free_match(features[f]);
+  }
+  free(features);
+  qsort(gp,N,sizeof(struct guided_pair),comp_pair);
+  for (i = j = 0; i < N; i++)
+    if (!j || gp[i].m != gp[j-1].m || gp[i].d != gp[j-1].d) gp[j++] = gp[i];
+  N = j;
+  qsort(gp,N,sizeof(struct guided_pair),comp_rank);
+  cm = malloc_array(int,N + 1);
+  cd = malloc_array(int,N + 1);
+  for (i = 0; i < N; i++) {
+    cm[i] = gp[i].m;
+    cd[i] = gp[i].d;
+  }
+  free(gp);
+  if (N < 4) {
+    free(cm);
+    free(cd);
+    return NULL;
+  }
+
+  //PROSAC growth function: tn is the expected number of the trials
+  //(out of all of them) whose sample lies in the top n, and tp the trial
+  //at which n is grown.
+  tn = trials;
+  for (i = 0; i < 4; i++) tn *= (double) (4 - i) / (N - i);
+  n = 4;
+  tp = 1;
+
+  features = malloc_array(Match,trials);
+  for (t = 1; t <= trials; t++) {
+    if (t > tp && n < N) {
+      tn1 = tn * (n + 1) / (n + 1 - 4);
+      tp += (int) ceil(tn1 - tn);
+      tn = tn1;
+      n++;
+    }
+
+    match = allocate_match(4);
+    match->size = 4;
+    match->error = ms - 4.0;
+    k = 0;
+    //until the schedule runs out, every sample includes the newest
+    //correspondence and three older ones
+    if (t <= tp) {
+      match->m[0] = cm[n-1];
+      match->d[0] = cd[n-1];
+      k = 1;
+    }
+    for (; k < 4; k++) {
+      i = draw_guided_pair(match,k,cm,cd,t <= tp ? n - 1 : n);
+      match->m[k] = cm[i];
+      match->d[k] = cd[i];
+    }
+    match->trial_num = t - 1;
+    features[t-1] = match;
+  }
+
+  free(cm);
+  free(cd);
+  return features;
+}
@@ -14,12 +14,23 @@
 
 #include "pntset.h"
 
+//the points of a set bucketed by quadrant, see quarter_pointset
+typedef struct {
+  int size;
+  int* index;    //point indices, quadrant by quadrant
+  int start[5];  //quadrant q is index[start[q]] up to index[start[q+1]]
+} QuarterListData;
+
+typedef QuarterListData* QuarterList;
+
 #ifdef __CPLUSPLUS
 extern "C" {
 #endif
 
-  char* quarter_pointset(PointSet);
-  Match random_quarter_match(PntMatchProblem, char*);
+  QuarterList quarter_pointset(PointSet);
+  void free_quarter_list(QuarterList);
+  Match random_quarter_match(PntMatchProblem, QuarterList);
+  Match* guided_ransac_matches(PntMatchProblem, int);
 
 #ifdef __CPLUSPLUS
 }
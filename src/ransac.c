@@ -21,16 +21,9 @@
 #include "pntmatch.h"
 #include "pmproblem.h"
 #include "jadutil.h"
+#include "jadmath.h"
 #include "lsearch.h"
 
-// This routine takes two point sets, and returns a match with represents 
-// the correspondence between the two given no further transformation.
-// The routine finds the distance between all pairs of points, and then
-// adds pairs to the match in the order of least distance. The match is
-// constrained to be one to one. This routine sits at the heart of ransac.
-// The ransac routine is really just a wrapper around the book
-// keeping needed to use this routine in that context.
-
 //the match member passed must have sufficent space for the pairs to be
 //placed in it, usually this means min(ms,ds). 
 
@@ -38,15 +31,17 @@ void* init_ransac_context(void* p)
 {
   RansacContext* rc;
   PntMatchProblem problem;
-  int i;
   
   problem = (PntMatchProblem) p;
   rc = (RansacContext*) malloc(sizeof(RansacContext));
   rc->dtaken = malloc_array(char,problem->data->size);
   rc-> mtaken = malloc_array(char,problem->model->size);
-  rc->dist_table = malloc_array(double*,problem->model->size);
-  for (i = 0; i < problem->model->size; i++) 
-    rc->dist_table[i] = malloc_array(double,problem->data->size);
+  rc->near = malloc_array(int,problem->data->size);
+  rc->cand_alloc = problem->model->size;
+  rc->cand = malloc_array(RansacPair,rc->cand_alloc);
+  rc->screen = 0;
+  rc->seed = 1;
+  rc->rejected = 0;
   rc->trset = allocate_pointset(problem->model->size);
   rc->ch = get_search_context(problem);
   return (void*)rc;
@@ -59,113 +54,166 @@ void free_ransac_context(void* foo, void* r)
   rc = (RansacContext*) r;
   free(rc->mtaken);
   free(rc->dtaken);
-  free_list((void**)rc->dist_table,rc->trset->size);
+  free(rc->near);
+  free(rc->cand);
   free_pointset(rc->trset);
   free_search_context(NULL,rc->ch);
   free(rc);
 }
 
-Match closest_match_pairs(RansacContext* rc, PointSet data, double sigma,
-			  Match match)
+int compare_ransac_pair(const void* a, const void* b)
 {
-  int m,d;
-  int i,j;
-  double tmp;
+  RansacPair* p = (RansacPair*) a;
+  RansacPair* q = (RansacPair*) b;
+
+  if (p->dist != q->dist) return p->dist < q->dist ? -1 : 1;
+  if (p->m != q->m) return p->m < q->m ? -1 : 1;
+  if (p->d != q->d) return p->d < q->d ? -1 : 1;
+  return 0;
+}
+
+// This routine takes the transformed model (rc->trset) and the data, and
+// returns a match which represents the correspondence between the two
+// given no further transformation. Pairs are added to the match in the
+// order of least distance, closest first, and the match is constrained
+// to be one to one. This routine sits at the heart of ransac. The
+// ransac routine is really just a wrapper around the book keeping
+// needed to use this routine in that context.
+//
+// Only pairs within sigma can be used, so they are found with the grid
+// over the data (built from the same set) and sorted, rather than searching a full model x data
+// distance table for each one. Ties go to the lower model, then data,
+// index. As always, a model point whose closest remaining pair is to a
+// data point already taken is left out of the match.
+Match closest_match_pairs(RansacContext* rc, PointSet data, PointGrid grid,
+			  double sigma, Match match)
+{
+  int i,j,k,n,found;
+  double dx,dy;
+  int ncand = 0;
   int pair_num = 0;
   
-  //init section
-  m = rc->trset->size;
-  d = data->size;
-
   match->error = rc->trset->size;
-  
-  for (i = 0; i < d; i++)
+  for (i = 0; i < data->size; i++)
     rc->dtaken[i] = 0;
   
-  //this pair of loops builds the distance table
-  for (i = 0; i < m; i++) {
+  for (i = 0; i < rc->trset->size; i++) {
     rc->mtaken[i] = 0;
-    //dist_table[i] = (double*) malloc(sizeof(double) * d);
-    for (j = 0; j < d; j++) {
-      tmp = (rc->trset->x[i] - data->x[j]);
-      tmp *= tmp;
-      rc->dist_table[i][j] = tmp;
-      tmp = (rc->trset->y[i] - data->y[j]);
-      tmp *= tmp;	    
-      rc->dist_table[i][j] += tmp;
+    found = pointgrid_within(grid,rc->trset->x[i],rc->trset->y[i],sigma,
+			     rc->near);
+    if (ncand + found > rc->cand_alloc) {
+      rc->cand_alloc = max(2 * rc->cand_alloc,ncand + found);
+      rc->cand = (RansacPair*) realloc(rc->cand,
+				       sizeof(RansacPair) * rc->cand_alloc);
     }
-  }
-  
-  tmp = 0.0;
-  while (tmp <= sigma) {
-    tmp = 999999999.9999999;
-    m = -1;  //reuse these
-    d = -1;
-    //scan the table. m,d gets the closest pair
-    for (i = 0; i < rc->trset->size; i++)
-      for (j = 0; j < data->size; j++) 
-	if (rc->dist_table[i][j] < tmp) {
-	  tmp = rc->dist_table[i][j];
-	  m = i;
-	  d = j;
-	}
-    //if closest pair is less than sigma, add it to the match
-    if (tmp <= sigma) {
-      //make sure we don't pull this entry out again
-      rc->dist_table[m][d] = sigma * 512.0;
-      if (rc->mtaken[m]) continue;  rc->mtaken[m] = 1;
-      if (rc->dtaken[d]) continue;  rc->dtaken[d] = 1;
-      match->m[pair_num] = m;
-      match->d[pair_num] = d;
-      pair_num++;
-      match->error -= 1.0;  
+    for (k = 0; k < found; k++) {
+      j = rc->near[k];
+      //same arithmetic as pointgrid_within
+      dx = rc->trset->x[i] - data->x[j];
+      dx *= dx;
+      dy = rc->trset->y[i] - data->y[j];
+      dy *= dy;
+      rc->cand[ncand].dist = dx + dy;
+      rc->cand[ncand].m = i;
+      rc->cand[ncand].d = j;
+      ncand++;
     }
   }
+  qsort(rc->cand,ncand,sizeof(RansacPair),compare_ransac_pair);
+
+  for (n = 0; n < ncand; n++) {
+    i = rc->cand[n].m;
+    j = rc->cand[n].d;
+    if (rc->mtaken[i]) continue;
+    rc->mtaken[i] = 1;
+    if (rc->dtaken[j]) continue;
+    rc->dtaken[j] = 1;
+    match->m[pair_num] = i;
+    match->d[pair_num] = j;
+    pair_num++;
+    match->error -= 1.0;  
+  }
   match->size = pair_num;
   
   return match;
 }
 
+//Preemptive T(d,d) test of a hypothesis: pick d model points at random
+//(from rc->seed), and pass the pose only if every one of them
+//lands within sigma of some data point. A junk pose almost always fails
+//on the first point or two, for the cost of a grid lookup each, instead
+//of transforming and pairing the whole model.
+int ransac_screen(PntMatchProblem problem, RansacContext* rc, Pose pose,
+		  int d)
+{
+  double x,y;
+  int t,i;
+
+  for (t = 0; t < d; t++) {
+    i = rand_r(&rc->seed) % problem->model->size;
+    x = problem->model->x[i];
+    y = problem->model->y[i];
+    problem->transform(&x,&y,pose);
+    if (!pointgrid_within(problem->data_grid,x,y,problem->sigma,rc->near))
+      return 0;
+  }
+  return 1;
+}
+
 //to use fast ransac :
 //probe and result must have pose already allocated
 //rc must have been allocated
+//If rc->screen is set, the hypothesis is put through ransac_screen with
+//that many points first, and rc->screen is cleared. One that fails comes back with no pairs.
 int ransac_actual(PntMatchProblem problem, RansacContext* rc, 
 		 Match probe, Match result)
 {
+  int screen = rc->screen;
+
+  rc->screen = 0;
+  rc->rejected = 0;
   initial_context(problem,probe,rc->ch);
   if (rc->ch->pairs < problem->min_pairs) return 0;
   problem->pose_from_partial(rc->ch->partial,probe->pose);
-  transform_pointset_inplace(problem->model,probe->pose,
-			     problem->transform,rc->trset);
-  closest_match_pairs(rc,problem->data, problem->sigma,result);
+  if (screen && !ransac_screen(problem,rc,probe->pose,screen)) {
+    rc->rejected = 1;
+    result->size = 0;
+    result->error = problem->model->size;
+    return 0;
+  }
+  transform_points(problem,problem->model->x,problem->model->y,
+		   problem->model->size,probe->pose,rc->trset->x,rc->trset->y);
+  closest_match_pairs(rc,problem->data,problem->data_grid,problem->sigma,
+		      result);
   return 1;
 }
 
+//prev is left alone. Temporaries come out of the context's arena, which
+//the caller is expected to reset once the result has been used.
 int iransac_actual(PntMatchProblem problem, RansacContext* rc, 
 		 Match prev, Match match)
 {
   Match best;
   int steps = 0;
   int ittr = 0;
-  Pose pose;
 
-  pose = (Pose) malloc(sizeof(double) * problem->pose_dim);
-  best = copy_match(prev);
+  best = arena_match(rc->ch->arena,problem->model->size);
+  assign_match(best,prev);
+  best->pose = (Pose) arena_alloc(rc->ch->arena,
+				  sizeof(double) * problem->pose_dim);
   do {
-    best->pose = pose;
     ransac_actual(problem,rc,best,match);
     steps++;
+    //a hypothesis that fails the screen comes back empty, not as itself
+    if (rc->rejected) return steps;
     if (match->size < best->size) {
-      replace_match(match,best);
+      assign_match(match,best);
       return steps;
     }
     else if (match->size == best->size) ittr++;
     else ittr = 0;
-    best->pose = NULL;
-    free_match(best);
-    best = copy_match(match);
+    assign_match(best,match);
   } while (ittr < 3);
-  free(pose);
   return steps;
 }
 
@@ -198,27 +246,60 @@ int iransac(PntMatchProblem problem, Match probe)
   return !(steps > 0);
 }
 
-unsigned long expected_ransac_trials(PntMatchProblem problem, double odds)
+//Trials needed for the odds of drawing at least one all correct sample
+//of four pairs, if the model has this many inliers, to reach odds.
+double ransac_trials_for_pairs(PntMatchProblem problem, double pairs,
+			       double odds)
 {
   double tmp;
-  double pairs;
-  double ms, ds;
-
-  if (problem->solution) pairs = problem->solution->size;
-  else pairs = problem->model->size * 0.75;
+  double ms, ds, den;
 
+  if (pairs < 4.0) return HUGE_VAL;
   ms = problem->model->size;
   ds = problem->data->size;
   //compute m^4d^4 portion
   tmp = ms * ds; 
- ms--; ds--;
+  ms--; ds--;
   tmp *= ms * ds;
   ms--; ds--;
   tmp *= ms * ds;
   ms--; ds--;
   tmp *= ms * ds;
   pairs *= (pairs - 1.0) * (pairs - 2.0) * (pairs - 3.0);
-  tmp = log(1.0-odds)/log(-(pairs - tmp)/tmp);
-  tmp += 1.0;
-  return (unsigned long) tmp;
+  //with few inliers 1 - pairs/tmp rounds to 1, so take log1p
+  den = log1p(-pairs / tmp);
+  if (den == 0.0 || !isfinite(den)) return HUGE_VAL;
+  return log(1.0-odds)/den;
+}
+
+unsigned long expected_ransac_trials(PntMatchProblem problem, double odds)
+{
+  double pairs;
+
+  if (problem->solution) pairs = problem->solution->size;
+  else pairs = problem->model->size * 0.75;
+  return (unsigned long) (ransac_trials_for_pairs(problem,pairs,odds) + 1.0);
+}
+
+//Adaptive RANSAC. Called with the result of each trial when the problem
+//sets a confidence. The inliers of the best result so far are taken as
+//the model's, and once enough trials have run for that confidence of
+//having drawn a correct sample, the search is cancelled. The best only
+//grows, so the trials needed only shrink as the search goes on. A
+//hypothesis that failed the preemptive screen comes back with no pairs,
+//so it counts as a trial but never as the best.
+void note_ransac_trial(PntMatchProblem problem, Match result)
+{
+  int best;
+  unsigned long done;
+
+  if (problem->confidence <= 0.0) return;
+  best = problem->best_pairs;
+  while (result->size > best &&
+	 !__sync_bool_compare_and_swap(&problem->best_pairs,best,result->size))
+    best = problem->best_pairs;
+  if (result->size > best) best = result->size;
+  done = __sync_add_and_fetch(&problem->trials_done,1);
+  if (done >= ransac_trials_for_pairs(problem,best,problem->confidence))
+    problem->cancel = 1;
 }
@@ -0,0 +1,96 @@
+/**
+ * @file rigid.c
+ * @author Jason Denton
+ * @version 0.95
+ * @date May, 2009
+ *
+ * Copyright Jason Denton, 2009. This source code is made
+ * available under the terms of the new BSD license. See the file
+ * license.txt for the applicabe terms.
+ **/
+
+#include <math.h>
+#include "pntset.h"
+#include "pntmatch.h"
+#include "pmproblem.h"
+
+//pose[0] = cos(theta)
+//pose[1] = sin(theta)
+//pose[2] = tx
+//pose[3] = ty
+//the similarity layout with the scale fixed at one, so the similarity
+//transform, pose_shift and context routines serve rigid problems as is.
+//Only the pose solution differs.
+
+//A rigid pose cannot stretch the model, so it is never degenerate.
+double degeneracy_rigid(PointSet model, Pose pose, double scale)
+{
+  return 0.0;
+}
+
+//Closed form least squares rotation and translation, from the
+//similarity context. About the centroids, the best angle is that of the
+//sum over pairs of conj(x + iy) * (u + iv); translation takes the
+//rotated model centroid to the data centroid.
+void pose_from_partial_rigid(double* context, Pose pose)
+{
+  double n,a,b,r;
+
+  n = context[9];
+  a = context[4] + context[5] -
+    (context[0] * context[2] + context[1] * context[3]) / n;
+  b = context[6] - context[7] -
+    (context[0] * context[3] - context[1] * context[2]) / n;
+  r = sqrt(a * a + b * b);
+  if (r > 0.0) {
+    pose[0] = a / r;
+    pose[1] = b / r;
+  }
+  else {
+    //no rotation is better than any other
+    pose[0] = 1.0;
+    pose[1] = 0.0;
+  }
+  pose[2] = (context[2] - pose[0] * context[0] + pose[1] * context[1]) / n;
+  pose[3] = (context[3] - pose[1] * context[0] - pose[0] * context[1]) / n;
+}
+
+//Poses for partial + each lane of a batched similarity context.
+int pose_from_partial_batch_rigid(double* factor, double* partial,
+				  double* context, double* poses)
+{
+  double lane[10];
+  int j,k;
+
+  for (k = 0; k < PM_BATCH; k++) {
+    for (j = 0; j < 10; j++) lane[j] = partial[j] + context[j*PM_BATCH+k];
+    pose_from_partial_rigid(lane,poses+k*4);
+  }
+  return (1 << PM_BATCH) - 1;
+}
+
+//Signature of an ordered cluster that rigid transforms leave alone. With
+//p the key point and q, r the next two, the lengths of q - p and r - p
+//(as logs, so the tolerance is relative) and the cosine and sine of the
+//angle between them.
+//
+//return : The number of values in sig, 0 if the cluster has none.
+int cluster_invariant_rigid(PointSet pset, int* cluster, int size,
+			    double* sig)
+{
+  double qx,qy,rx,ry,lq,lr;
+
+  if (size < 3) return 0;
+  qx = pset->x[cluster[1]] - pset->x[cluster[0]];
+  qy = pset->y[cluster[1]] - pset->y[cluster[0]];
+  rx = pset->x[cluster[2]] - pset->x[cluster[0]];
+  ry = pset->y[cluster[2]] - pset->y[cluster[0]];
+  lq = sqrt(qx * qx + qy * qy);
+  lr = sqrt(rx * rx + ry * ry);
+  if (lq == 0.0 || lr == 0.0) return 0;
+  sig[0] = log(lq);
+  sig[1] = log(lr);
+  sig[2] = (qx * rx + qy * ry) / (lq * lr);
+  sig[3] = (qx * ry - qy * rx) / (lq * lr);
+  return 4;
+}
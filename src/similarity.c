@@ -12,6 +12,7 @@
 #include <math.h>
 #include "pntset.h"
 #include "pntmatch.h"
+#include "pmproblem.h"
 
 //pose[0] = alpha
 //pose[1] = beta
@@ -30,6 +31,36 @@ void transform_similarity(double* x, double* y, Pose pose)
   *y = ty;
 }
 
+//transform_similarity over n points. See PM_TRANSFORM_KERNEL.
+PM_TRANSFORM_KERNEL
+void transform_batch_similarity(double* restrict x, double* restrict y,
+				int n, Pose pose, double* restrict tx,
+				double* restrict ty)
+{
+  double p0 = pose[0], p1 = pose[1], p2 = pose[2], p3 = pose[3];
+  int i;
+
+  for (i = 0; i < n; i++) {
+    tx[i] = x[i] * p0 - y[i] * p1 + p2;
+    ty[i] = x[i] * p1 + y[i] * p0 + p3;
+  }
+}
+
+//transform_batch_similarity in single precision.
+PM_TRANSFORM_KERNEL
+void transform_batch_float_similarity(float* restrict x, float* restrict y,
+				      int n, Pose pose, float* restrict tx,
+				      float* restrict ty)
+{
+  float p0 = pose[0], p1 = pose[1], p2 = pose[2], p3 = pose[3];
+  int i;
+
+  for (i = 0; i < n; i++) {
+    tx[i] = x[i] * p0 - y[i] * p1 + p2;
+    ty[i] = x[i] * p1 + y[i] * p0 + p3;
+  }
+}
+
 double degeneracy_similarity(PointSet model, Pose pose, double scale)
 {
   double sc;
@@ -44,6 +75,21 @@ double degeneracy_similarity(PointSet model, Pose pose, double scale)
   return sc;
 }
 
+//Upper bound on the distance any point in the model's bounding box
+//moves when the pose changes from p to q.
+double pose_shift_similarity(PointSet model, Pose p, Pose q)
+{
+  double X,Y,da,db,ex,ey;
+
+  X = max(fabs(model->lx),fabs(model->ux));
+  Y = max(fabs(model->ly),fabs(model->uy));
+  da = fabs(p[0] - q[0]);
+  db = fabs(p[1] - q[1]);
+  ex = da * X + db * Y + fabs(p[2] - q[2]);
+  ey = db * X + da * Y + fabs(p[3] - q[3]);
+  return sqrt(ex * ex + ey * ey);
+}
+
 void context_for_pair_similarity(double x, double y, double u, double v,
 				 double* context)
 {
@@ -85,3 +131,66 @@ void pose_from_partial_similarity(double* context, Pose pose)
   if (pose[3] < 0.000000001 && pose[3] > -0.000000001) pose[3] = 0.0;
 
 }
+
+//context_for_pair_similarity for the model point x,y paired with each of
+//the PM_BATCH data points u[k],v[k], term j of lane k at
+//context[j*PM_BATCH+k].
+void context_for_pairs_batch_similarity(double x, double y, double* u,
+					double* v, double* context)
+{
+  int k;
+
+  for (k = 0; k < PM_BATCH; k++) {
+    context[0*PM_BATCH+k] = x;
+    context[1*PM_BATCH+k] = y;
+    context[2*PM_BATCH+k] = u[k];
+    context[3*PM_BATCH+k] = v[k];
+    context[4*PM_BATCH+k] = x * u[k];
+    context[5*PM_BATCH+k] = y * v[k];
+    context[6*PM_BATCH+k] = x * v[k];
+    context[7*PM_BATCH+k] = y * u[k];
+    context[8*PM_BATCH+k] = x * x + y * y;
+    context[9*PM_BATCH+k] = 1.0;
+  }
+}
+
+//Poses for partial + each lane of a batched context. The similarity
+//solution is closed form, so no factor is needed and every lane is
+//solved.
+int pose_from_partial_batch_similarity(double* factor, double* partial,
+				       double* context, double* poses)
+{
+  double lane[10];
+  int j,k;
+
+  for (k = 0; k < PM_BATCH; k++) {
+    for (j = 0; j < 10; j++) lane[j] = partial[j] + context[j*PM_BATCH+k];
+    pose_from_partial_similarity(lane,poses+k*4);
+  }
+  return (1 << PM_BATCH) - 1;
+}
+
+//Signature of an ordered cluster that similarity transforms leave alone.
+//With p the key point and q, r the next two, (r - p) / (q - p) as a
+//complex number is unchanged; we give its log length and the cosine and
+//sine of its angle, so that no value wraps around.
+//
+//return : The number of values in sig, 0 if the cluster has none.
+int cluster_invariant_similarity(PointSet pset, int* cluster, int size,
+				 double* sig)
+{
+  double qx,qy,rx,ry,lq,lr;
+
+  if (size < 3) return 0;
+  qx = pset->x[cluster[1]] - pset->x[cluster[0]];
+  qy = pset->y[cluster[1]] - pset->y[cluster[0]];
+  rx = pset->x[cluster[2]] - pset->x[cluster[0]];
+  ry = pset->y[cluster[2]] - pset->y[cluster[0]];
+  lq = sqrt(qx * qx + qy * qy);
+  lr = sqrt(rx * rx + ry * ry);
+  if (lq == 0.0 || lr == 0.0) return 0;
+  sig[0] = log(lr / lq);
+  sig[1] = (qx * rx + qy * ry) / (lq * lr);
+  sig[2] = (qx * ry - qy * rx) / (lq * lr);
+  return 3;
+}
@@ -16,10 +16,12 @@
 // To add a transformation class, write the appropriate three functions
 // (transform, degeneracy, and pose determination), place their prototypes
 // here, and modify pmproblem.c to understand the new class. A #define
-// may also be needed in pmproblem.h
+// may also be needed in pmproblem.h. Classes used for real work should
+// also get their own local search engine in lsearch.c.
 
 #include "pntset.h"
 #include "pntmatch.h"
+#include "pmproblem.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,18 +31,70 @@ void transform_projective(double*, double*, Pose);
 double degeneracy_projective(PointSet, Pose, double);
 void context_for_pair_projective(double, double, double, double, double*);
 void pose_from_partial_projective(double*, Pose);
+double pose_shift_projective(PointSet, Pose, Pose);
+int factor_from_partial_projective(double*, double*);
+int factor_pair_projective(double*, double, double, double, double, double);
+void pose_from_factor_projective(double*, double*, Pose);
+void context_for_pairs_batch_projective(double, double, double*, double*,
+					double*);
+int pose_from_partial_batch_projective(double*, double*, double*, double*);
+int cluster_invariant_projective(PointSet, int*, int, double*);
+void transform_batch_projective(double*, double*, int, Pose, double*, double*);
+void transform_batch_float_projective(float*, float*, int, Pose, float*,
+				      float*);
 
 void transform_similarity(double*, double*, Pose);
 double degeneracy_similarity(PointSet, Pose, double);
 void context_for_pair_similarity(double, double, double, double, double*);
 void pose_from_partial_similarity(double*, Pose);
-
+double pose_shift_similarity(PointSet, Pose, Pose);
+void context_for_pairs_batch_similarity(double, double, double*, double*,
+					double*);
+int pose_from_partial_batch_similarity(double*, double*, double*, double*);
+int cluster_invariant_similarity(PointSet, int*, int, double*);
+void transform_batch_similarity(double*, double*, int, Pose, double*, double*);
+void transform_batch_float_similarity(float*, float*, int, Pose, float*,
+				      float*);
 
 void transform_affine(double*, double*, Pose);
+void transform_batch_affine(double*, double*, int, Pose, double*, double*);
+void transform_batch_float_affine(float*, float*, int, Pose, float*, float*);
 double degeneracy_affine(PointSet, Pose, double);
 void context_for_pair_affine(double, double, double, double, double*);
 void pose_from_partial_affine(double*, Pose);
+double pose_shift_affine(PointSet, Pose, Pose);
+void context_for_pairs_batch_affine(double, double, double*, double*,
+				    double*);
+int pose_from_partial_batch_affine(double*, double*, double*, double*);
+int cluster_invariant_affine(PointSet, int*, int, double*);
+
+//rigid poses use the similarity layout, see rigid.c
+double degeneracy_rigid(PointSet, Pose, double);
+void pose_from_partial_rigid(double*, Pose);
+int pose_from_partial_batch_rigid(double*, double*, double*, double*);
+int cluster_invariant_rigid(PointSet, int*, int, double*);
+
+void transform_translation(double*, double*, Pose);
+void transform_batch_translation(double*, double*, int, Pose, double*,
+				 double*);
+void transform_batch_float_translation(float*, float*, int, Pose, float*,
+				       float*);
+double degeneracy_translation(PointSet, Pose, double);
+void context_for_pair_translation(double, double, double, double, double*);
+void pose_from_partial_translation(double*, Pose);
+double pose_shift_translation(PointSet, Pose, Pose);
+void context_for_pairs_batch_translation(double, double, double*, double*,
+					 double*);
+int pose_from_partial_batch_translation(double*, double*, double*, double*);
+int cluster_invariant_translation(PointSet, int*, int, double*);
 
+//local search engines, see lsearch.c
+extern const SearchEngineData search_engine_generic;
+extern const SearchEngineData search_engine_projective;
+extern const SearchEngineData search_engine_similarity;
+extern const SearchEngineData search_engine_affine;
+extern const SearchEngineData search_engine_rigid;
+extern const SearchEngineData search_engine_translation;
 
 #ifdef __cplusplus
 }
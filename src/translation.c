@@ -0,0 +1,135 @@
+/**
+ * @file translation.c
+ * @author Jason Denton
+ * @version 0.95
+ * @date May, 2009
+ *
+ * Copyright Jason Denton, 2009. This source code is made
+ * available under the terms of the new BSD license. See the file
+ * license.txt for the applicabe terms.
+ **/
+
+#include <math.h>
+#include "pntset.h"
+#include "pntmatch.h"
+#include "pmproblem.h"
+
+//pose[0] = tx
+//pose[1] = ty
+
+void transform_translation(double* x, double* y, Pose pose)
+{
+  *x += pose[0];
+  *y += pose[1];
+}
+
+//transform_translation over n points. See PM_TRANSFORM_KERNEL.
+PM_TRANSFORM_KERNEL
+void transform_batch_translation(double* restrict x, double* restrict y,
+				 int n, Pose pose, double* restrict tx,
+				 double* restrict ty)
+{
+  double p0 = pose[0], p1 = pose[1];
+  int i;
+
+  for (i = 0; i < n; i++) {
+    tx[i] = x[i] + p0;
+    ty[i] = y[i] + p1;
+  }
+}
+
+//transform_batch_translation in single precision.
+PM_TRANSFORM_KERNEL
+void transform_batch_float_translation(float* restrict x, float* restrict y,
+				       int n, Pose pose, float* restrict tx,
+				       float* restrict ty)
+{
+  float p0 = pose[0], p1 = pose[1];
+  int i;
+
+  for (i = 0; i < n; i++) {
+    tx[i] = x[i] + p0;
+    ty[i] = y[i] + p1;
+  }
+}
+
+//A translation cannot stretch the model, so it is never degenerate.
+double degeneracy_translation(PointSet model, Pose pose, double scale)
+{
+  return 0.0;
+}
+
+//Every point moves by the same amount.
+double pose_shift_translation(PointSet model, Pose p, Pose q)
+{
+  double dx,dy;
+
+  dx = p[0] - q[0];
+  dy = p[1] - q[1];
+  return sqrt(dx * dx + dy * dy);
+}
+
+void context_for_pair_translation(double x, double y, double u, double v,
+				  double* context)
+{
+  context[0] = u - x;
+  context[1] = v - y;
+  context[2] = 1.0;
+}
+
+//The least squares translation is the mean offset.
+void pose_from_partial_translation(double* context, Pose pose)
+{
+  pose[0] = context[0] / context[2];
+  pose[1] = context[1] / context[2];
+}
+
+//context_for_pair_translation for the model point x,y paired with each
+//of the PM_BATCH data points u[k],v[k], term j of lane k at
+//context[j*PM_BATCH+k].
+void context_for_pairs_batch_translation(double x, double y, double* u,
+					 double* v, double* context)
+{
+  int k;
+
+  for (k = 0; k < PM_BATCH; k++) {
+    context[0*PM_BATCH+k] = u[k] - x;
+    context[1*PM_BATCH+k] = v[k] - y;
+    context[2*PM_BATCH+k] = 1.0;
+  }
+}
+
+//Poses for partial + each lane of a batched context.
+int pose_from_partial_batch_translation(double* factor, double* partial,
+					double* context, double* poses)
+{
+  double lane[3];
+  int j,k;
+
+  for (k = 0; k < PM_BATCH; k++) {
+    for (j = 0; j < 3; j++) lane[j] = partial[j] + context[j*PM_BATCH+k];
+    pose_from_partial_translation(lane,poses+k*2);
+  }
+  return (1 << PM_BATCH) - 1;
+}
+
+//Signature of an ordered cluster that translations leave alone: the
+//length of the offset from the key point to the next (as a log, so the
+//tolerance is relative) and the cosine and sine of its direction.
+//
+//return : The number of values in sig, 0 if the cluster has none.
+int cluster_invariant_translation(PointSet pset, int* cluster, int size,
+				  double* sig)
+{
+  double qx,qy,lq;
+
+  if (size < 2) return 0;
+  qx = pset->x[cluster[1]] - pset->x[cluster[0]];
+  qy = pset->y[cluster[1]] - pset->y[cluster[0]];
+  lq = sqrt(qx * qx + qy * qy);
+  if (lq == 0.0) return 0;
+  sig[0] = log(lq);
+  sig[1] = qx / lq;
+  sig[2] = qy / lq;
+  return 3;
+}